@@ -100,10 +100,32 @@ struct ext2_super_block {
 	unsigned short s_reserved_word_pad;
 	unsigned int   s_default_mount_opts;
 	unsigned int   s_first_meta_bg; /* First metablock block group */
-	unsigned int   s_reserved[190]; /* Padding to the end of the block */
+	unsigned int   s_reserved[27];
+	/*
+	 * Metadata checksums, valid if EXT2_FEATURE_RO_COMPAT_METADATA_CSUM
+	 * is set. The fields sit where ext4 has them.
+	 */
+	unsigned char  s_log_groups_per_flex;
+	unsigned char  s_checksum_type;  /* EXT2_CRC32C_CHKSUM */
+	unsigned short s_reserved_pad;
+	unsigned int   s_reserved2[161]; /* Padding to the checksum */
+	unsigned int   s_checksum;       /* crc32c(superblock) */
 };
 
 
+#define    EXT2_SUPER_MAGIC  0xEF53
+
+/*
+ * Feature set definitions
+ */
+#define    EXT2_FEATURE_INCOMPAT_FILETYPE  0x0002
+#define    EXT2_FEATURE_RO_COMPAT_METADATA_CSUM  0x0400
+
+#define    EXT2_CRC32C_CHKSUM  1
+
+#define    EXT2_GOOD_OLD_INODE_SIZE  128
+
+
 /*
  * Structure of a blocks group descriptor
  */
@@ -115,11 +137,22 @@ struct ext2_group_desc
 	unsigned short bg_free_blocks_count; /* Free blocks count */
 	unsigned short bg_free_inodes_count; /* Free inodes count */
 	unsigned short bg_used_dirs_count;   /* Directories count */
-	/* The pad and reserved fields should be 0 for the assignment. */
-	unsigned short bg_pad;
-	unsigned int   bg_reserved[3];
+	unsigned short bg_flags;             /* EXT2_BG_* flags */
+	/* The fields below should be 0 for the assignment without metadata_csum. */
+	unsigned int   bg_exclude_bitmap_lo;
+	unsigned short bg_block_bitmap_csum_lo; /* crc32c(block bitmap) & 0xFFFF */
+	unsigned short bg_inode_bitmap_csum_lo; /* crc32c(inode bitmap) & 0xFFFF */
+	unsigned short bg_itable_unused;     /* Never used inodes at the table's end */
+	unsigned short bg_checksum;          /* crc32c(group descriptor) & 0xFFFF */
 };
 
+/*
+ * Block group flags
+ */
+#define    EXT2_BG_INODE_ZEROED  0x0004    /* On-disk inode table is zeroed */
+/* Not an ext4 flag: free inode table slots were never written by ext2_mkfs */
+#define    EXT2_BG_INODE_LAZY    0x8000
+
 
 /*
  * Structure of an inode on the disk
@@ -151,7 +184,9 @@ struct ext2_inode {
 	unsigned int   i_file_acl;    /* File ACL */
 	unsigned int   i_dir_acl;     /* Directory ACL */
 	unsigned int   i_faddr;       /* Fragment address */
-	unsigned int   extra[3];
+	unsigned int   extra[2];
+	unsigned short i_checksum_lo; /* crc32c(inode) & 0xFFFF, with metadata_csum */
+	unsigned short i_reserved;
 };
 
 
@@ -195,6 +230,18 @@ struct ext2_dir_entry {
 	char           name[];    /* File name, up to EXT2_NAME_LEN */
 };
 
+/*
+ * With metadata_csum every directory block ends in this fake entry,
+ * holding the block's checksum.
+ */
+struct ext2_dir_entry_tail {
+	unsigned int   det_reserved_zero1; /* Pretend to be unused */
+	unsigned short det_rec_len;        /* 12 */
+	unsigned char  det_reserved_zero2; /* Zero name length */
+	unsigned char  det_reserved_ft;    /* EXT2_FT_DIR_CSUM */
+	unsigned int   det_checksum;       /* crc32c(uuid+inum+dirblock) */
+};
+
 
 /*
 ￼
@@ -214,5 +261,7 @@ Find
 /* #define EXT2_FT_SOCK     6 */ /* Socket File */
 
 #define    EXT2_FT_MAX      8
+/* File type of the checksum tail of a dir block */
+#define    EXT2_FT_DIR_CSUM 0xDE
 
 #endif
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <time.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+// Generated images default to 8 MiB with one inode per 4 KiB, about half
+// full, 16 entries per directory and no fragmentation.
+#define DEFAULT_BLOCKS_COUNT 8192
+#define DEFAULT_INODE_RATIO "4096"
+#define DEFAULT_FILL 50
+#define DEFAULT_FANOUT 16
+#define DEFAULT_FRAGMENTATION 0
+#define DEFAULT_ITERATIONS 100
+// Generated files take 1 to MAX_FILE_BLOCKS blocks, so some of them
+// need the indirect block
+#define MAX_FILE_BLOCKS 24
+// The helpers are cheap, so they are timed this many times more often
+#define HELPER_SCALE 10
+#define BENCH_SEED 369
+#define PATH_LEN 64
+
+// Directory holding ext2_mkfs, ext2_cp, ... (the one ext2_bench is in)
+char tool_dir[PATH_MAX / 2];
+// Native source files for ext2_cp, one per size in blocks
+char src_dir[PATH_MAX / 2];
+// Paths of the files in the generated image
+char (*files)[PATH_LEN];
+int file_count;
+int dir_count;
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONAL -s blocks count] [OPTIONAL -f fill percent] "
+            "[OPTIONAL -d entries per directory] [OPTIONAL -r fragmentation percent] "
+            "[OPTIONAL -n iterations] <image file name>\n", prog);
+    exit(1);
+}
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// run_tool runs one of the ext2 tools with the NULL terminated arguments
+// and its output discarded. It stores the wall time in *elapsed (in
+// microseconds) and returns the tool's exit status.
+int run_tool(double *elapsed, char *tool, ...) {
+    char path[PATH_MAX];
+    char *args[8];
+    int n = 0;
+    snprintf(path, sizeof(path), "%s/%s", tool_dir, tool);
+    args[n++] = path;
+    va_list ap;
+    va_start(ap, tool);
+    char *arg;
+    while ((arg = va_arg(ap, char *)) != NULL && n < 7) {
+        args[n++] = arg;
+    }
+    va_end(ap);
+    args[n] = NULL;
+
+    double start = now_us();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execv(path, args);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(1);
+    }
+    *elapsed = now_us() - start;
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return 128 + WTERMSIG(status);
+}
+
+// Same as run_tool, for steps that must succeed
+void must_run(char *tool, char *a, char *b, char *c, char *d) {
+    double elapsed;
+    int status = run_tool(&elapsed, tool, a, b, c, d, NULL);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: %s %s %s %s failed with status %d\n", tool,
+                a ? a : "", b ? b : "", c ? c : "", status);
+        exit(1);
+    }
+}
+
+// src_file returns a native file of just under blocks blocks, creating it
+// on first use.
+char *src_file(int blocks) {
+    static char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/src%d", src_dir, blocks);
+    if (access(path, F_OK) == 0) {
+        return path;
+    }
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    for (int i = 0; i < blocks * EXT2_BLOCK_SIZE - 100; i++) {
+        fputc(rand() & 0xff, fp);
+    }
+    fclose(fp);
+    return path;
+}
+
+void copy_image(char *from, char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in == -1 || out == -1) {
+        perror("open");
+        exit(1);
+    }
+    char buf[64 * EXT2_BLOCK_SIZE];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(in);
+    close(out);
+}
+
+int free_blocks(char *image) {
+    open_image(image);
+    int count = sb->s_free_blocks_count;
+    close_image();
+    return count;
+}
+
+// Copy a file of random size into the image, starting a new directory
+// every fanout files. It returns 0 once the image has no room for it.
+int add_file(char *image, int fanout, int min_blocks) {
+    char path[PATH_LEN];
+    double elapsed;
+    if (file_count % fanout == 0) {
+        snprintf(path, sizeof(path), "/d%d", dir_count);
+        if (run_tool(&elapsed, "ext2_mkdir", image, path, NULL) != 0) {
+            return 0;
+        }
+        dir_count++;
+    }
+    int blocks = min_blocks + rand() % (MAX_FILE_BLOCKS - min_blocks + 1);
+    snprintf(path, sizeof(path), "/d%d/f%d", dir_count - 1, file_count);
+    if (run_tool(&elapsed, "ext2_cp", image, src_file(blocks), path, NULL) != 0) {
+        return 0;
+    }
+    strcpy(files[file_count++], path);
+    return 1;
+}
+
+// generate builds an image of blocks_count blocks whose data blocks are
+// fill percent used by files spread over directories of fanout entries.
+// With fragmentation, that percentage of the files is then removed and
+// replaced by larger files, which end up split across the holes left behind.
+void generate(char *image, int blocks_count, int fill, int fanout, int fragmentation) {
+    char count[16];
+    snprintf(count, sizeof(count), "%d", blocks_count);
+    unlink(image);
+    must_run("ext2_mkfs", "-i", DEFAULT_INODE_RATIO, image, count);
+
+    open_image(image);
+    int inodes_count = sb->s_inodes_count;
+    close_image();
+    files = malloc(inodes_count * sizeof(*files));
+    if (files == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int initial_free = free_blocks(image);
+    int target_free = initial_free - (long long)initial_free * fill / 100;
+    while (free_blocks(image) > target_free && add_file(image, fanout, 1)) {
+    }
+
+    int removed = file_count * fragmentation / 100;
+    for (int i = 0; i < removed; i++) {
+        int victim = rand() % file_count;
+        must_run("ext2_rm", image, files[victim], NULL, NULL);
+        strcpy(files[victim], files[--file_count]);
+    }
+    while (removed > 0 && free_blocks(image) > target_free &&
+           add_file(image, fanout, MAX_FILE_BLOCKS / 2)) {
+    }
+
+    int fragmented = 0;
+    open_image(image);
+    for (int i = EXT2_GOOD_OLD_FIRST_INO; i < sb->s_inodes_count; i++) {
+        if (is_set(inode_bitmap, i + 1) && count_fragments(i + 1) > 1) {
+            fragmented++;
+        }
+    }
+    printf("image=%s blocks=%d inodes=%d used_blocks=%d dirs=%d files=%d fragmented_files=%d\n",
+           image, sb->s_blocks_count, sb->s_inodes_count, sb->s_blocks_count - sb->s_free_blocks_count,
+           dir_count, file_count, fragmented);
+    close_image();
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(double *)a;
+    double y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+// Print one result line: throughput and latency percentiles of n samples.
+void report(char *op, double *samples, int n) {
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        total += samples[i];
+    }
+    qsort(samples, n, sizeof(double), compare_double);
+    int p99 = n * 99 / 100;
+    if (p99 >= n) {
+        p99 = n - 1;
+    }
+    printf("op=%s iterations=%d ops_per_sec=%.1f mean_us=%.3f p50_us=%.3f p99_us=%.3f\n",
+           op, n, total > 0 ? n / (total / 1e6) : 0, total / n, samples[n / 2], samples[p99]);
+    fflush(stdout);
+}
+
+// Time each tool on a copy of the generated image. Every step works on
+// what the step before it created: the copied files are linked, the links
+// removed and then restored. The links are symbolic since a removed hard
+// link leaves its inode in use, and such an entry cannot be restored.
+void bench_tools(char *work, int iterations, double *samples) {
+    char path[PATH_LEN];
+    char target[PATH_LEN];
+    char *ops[] = { "mkdir", "cp", "ln_s", "rm", "restore", "checker" };
+    for (int op = 0; op < 6; op++) {
+        for (int i = 0; i < iterations; i++) {
+            int status;
+            switch (op) {
+            case 0:
+                snprintf(path, sizeof(path), "/bm%d", i);
+                status = run_tool(&samples[i], "ext2_mkdir", work, path, NULL);
+                break;
+            case 1:
+                snprintf(path, sizeof(path), "/bc%d", i);
+                status = run_tool(&samples[i], "ext2_cp", work, src_file(1), path, NULL);
+                break;
+            case 2:
+                snprintf(target, sizeof(target), "/bc%d", i);
+                snprintf(path, sizeof(path), "/bl%d", i);
+                status = run_tool(&samples[i], "ext2_ln", work, "-s", target, path, NULL);
+                break;
+            case 3:
+                snprintf(path, sizeof(path), "/bl%d", i);
+                status = run_tool(&samples[i], "ext2_rm", work, path, NULL);
+                break;
+            case 4:
+                snprintf(path, sizeof(path), "/bl%d", i);
+                status = run_tool(&samples[i], "ext2_restore", work, path, NULL);
+                break;
+            default:
+                status = run_tool(&samples[i], "ext2_checker", work, NULL);
+                break;
+            }
+            if (status != 0) {
+                fprintf(stderr, "ERROR: ext2_%s failed with status %d on iteration %d\n", ops[op], status, i);
+                exit(1);
+            }
+        }
+        report(ops[op], samples, iterations);
+    }
+}
+
+// Time the helpers the tools spend their time in, in-process on a copy of
+// the generated image. Every change a helper makes is undone after it is timed.
+void bench_helpers(char *work, int iterations, double *samples) {
+    if (file_count == 0) {
+        fprintf(stderr, "ERROR: the image has no files, helpers are not timed\n");
+        return;
+    }
+    char path[PATH_LEN];
+    int parent;
+    double start;
+    open_image(work);
+
+    for (int i = 0; i < iterations; i++) {
+        start = now_us();
+        int block = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
+        samples[i] = now_us() - start;
+        if (block == -1) {
+            fprintf(stderr, "ERROR: the image is full\n");
+            exit(1);
+        }
+        unset_bit(block_bitmap, block, BLOCK_BITMAP_SIZE);
+    }
+    report("find_next_available", samples, iterations);
+
+    for (int i = 0; i < iterations; i++) {
+        strcpy(path, files[rand() % file_count]);
+        inode_num(path, &parent);
+        char *name = strrchr(path, '/') + 1;
+        start = now_us();
+        check_exist(name, parent);
+        samples[i] = now_us() - start;
+    }
+    report("check_exist", samples, iterations);
+
+    for (int i = 0; i < iterations; i++) {
+        strcpy(path, files[rand() % file_count]);
+        start = now_us();
+        inode_num(path, &parent);
+        samples[i] = now_us() - start;
+    }
+    report("inode_num", samples, iterations);
+
+    for (int i = 0; i < iterations; i++) {
+        strcpy(path, files[rand() % file_count]);
+        int inode = inode_num(path, &parent);
+        start = now_us();
+        insert_dir_entry(inode, "bench_entry", parent, EXT2_FT_REG_FILE);
+        samples[i] = now_us() - start;
+        remove_dir_entry(inode, "bench_entry", parent);
+    }
+    report("insert_dir_entry", samples, iterations);
+
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    int blocks_count = DEFAULT_BLOCKS_COUNT;
+    int fill = DEFAULT_FILL;
+    int fanout = DEFAULT_FANOUT;
+    int fragmentation = DEFAULT_FRAGMENTATION;
+    int iterations = DEFAULT_ITERATIONS;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:d:r:n:")) != -1) {
+        switch (opt) {
+        case 's':
+            blocks_count = atoi(optarg);
+            break;
+        case 'f':
+            fill = atoi(optarg);
+            break;
+        case 'd':
+            fanout = atoi(optarg);
+            break;
+        case 'r':
+            fragmentation = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    if (fill < 0 || fill > 100 || fragmentation < 0 || fragmentation > 100) {
+        fprintf(stderr, "ERROR: percentages must be between 0 and 100\n");
+        exit(EINVAL);
+    }
+    if (fanout <= 0 || iterations <= 0) {
+        fprintf(stderr, "ERROR: entries per directory and iterations must be positive\n");
+        exit(EINVAL);
+    }
+
+    /******************************************************************
+	 * Generate the image
+	 ******************************************************************/
+    char self[PATH_MAX];
+    snprintf(self, sizeof(self), "%s", argv[0]);
+    snprintf(tool_dir, sizeof(tool_dir), "%s", dirname(self));
+    strcpy(src_dir, "/tmp/ext2_bench.XXXXXX");
+    if (mkdtemp(src_dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    srand(BENCH_SEED);
+
+    char *image = argv[optind];
+    char work[PATH_MAX];
+    snprintf(work, sizeof(work), "%s.work", image);
+    generate(image, blocks_count, fill, fanout, fragmentation);
+
+    /******************************************************************
+	 * Time the tools and the helpers
+	 ******************************************************************/
+    double *samples = malloc(iterations * HELPER_SCALE * sizeof(double));
+    if (samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    copy_image(image, work);
+    bench_tools(work, iterations, samples);
+    copy_image(image, work);
+    bench_helpers(work, iterations * HELPER_SCALE, samples);
+
+    unlink(work);
+    for (int i = 1; i <= MAX_FILE_BLOCKS; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/src%d", src_dir, i);
+        unlink(path);
+    }
+    rmdir(src_dir);
+    free(samples);
+    free(files);
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return 0;
+}
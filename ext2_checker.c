@@ -12,35 +12,22 @@
 #include <time.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
 
 int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    trace_op(argc, argv);
     if(argc != 2) {
         fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        exit(1);
-    }
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    // Initalize the global variables
-    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
-    block_bitmap = disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE;
-    inode_bitmap = disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE;
-    inode_table = (struct ext2_inode *)(disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    open_image(argv[1]);
     total_fixes = 0;
 
     /******************************************************************
 	 * Checker
 	 ******************************************************************/
+    stats_phase("check");
     int free_inodes_count = 0;
     int free_blocks_count = 0;
     int i;
@@ -81,84 +68,137 @@ int main(int argc, char **argv) {
         gd->bg_free_blocks_count = free_blocks_count;
         total_fixes += offset;
     }
+    if (total_fixes > 0) {
+        counts_lock();
+        update_group_csum();
+        counts_unlock();
+    }
 
      // Check if each file, directory or symlink is allocated in the inode bitmap
     if (!is_set(inode_bitmap, EXT2_ROOT_INO)) {
         fprintf(stderr, "Fixed: inode [%d] not marked as in-use\n", EXT2_ROOT_INO);
-        set_bit(inode_bitmap, EXT2_ROOT_INO, 4);
+        set_bit(inode_bitmap, EXT2_ROOT_INO, INODE_BITMAP_SIZE);
         total_fixes++;
     }
 
-    for (i = 10 ; i < sb->s_inodes_count; i++) {
+    // Slots of a lazily initialized inode table that are not in the bitmap
+    // were never written, so only bitmap-marked inodes are trusted there.
+    int lazy = INODE_TABLE_LAZY;
+    for (i = 10 ; i < sb->s_inodes_count && !lazy; i++) {
         if (inode_table[i].i_links_count > 0 && !is_set(inode_bitmap, i + 1)) {
             fprintf(stderr, "Fixed: inode [%d] not marked as in-use\n", i + 1);
-            set_bit(inode_bitmap, i + 1, 4);
+            set_bit(inode_bitmap, i + 1, INODE_BITMAP_SIZE);
             total_fixes++;
         }  
     }
 
-    // Check for data block allocation for each file, directory and symlink
-    int block_num;
-    int indirect_block_num;
-    unsigned char* indirect_block;
-    int indirect_idx;
-    int data_blocks = inode_table[EXT2_ROOT_INO - 1].i_blocks / 2;
-    if ( inode_table[EXT2_ROOT_INO - 1].i_blocks / 2 > 12 ) {
-        indirect_block_num = inode_table[EXT2_ROOT_INO - 1].i_block[12];
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
-        data_blocks--;
-    }
-
-    int D = 0;
-    int j;
-    for (j = 0; j < data_blocks ; j++) {
-        if (j < 12) {
-            block_num = inode_table[EXT2_ROOT_INO - 1].i_block[j];
-        } else {
-            indirect_idx = j - 12;
-            memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
+    // Check every link count against the entries that name the inode.
+    // Inodes no directory reaches are left alone rather than dropped to
+    // zero links, which would free a file that still holds data.
+    // An entry naming a free inode is only reported: the inode's blocks may
+    // already belong to another file, so it is not brought back to life.
+    int *links = count_links();
+    for (i = 1; i <= sb->s_inodes_count; i++) {
+        if (links[i] == 0 || links[i] == inode_table[i - 1].i_links_count) {
+            continue;
         }
-        if (!is_set(block_bitmap, block_num)) {
-            set_bit(block_bitmap, block_num, 16);
-            total_fixes++;
-            D++;
+        if (!is_set(inode_bitmap, i)) {
+            fprintf(stderr, "Found: %d entries name free inode [%d]\n", links[i], i);
+            continue;
         }
+        fprintf(stderr, "Fixed: inode [%d] link count was %d, should be %d\n", i,
+                inode_table[i - 1].i_links_count, links[i]);
+        inode_table[i - 1].i_links_count = links[i];
+        update_inode_csum(i);
+        total_fixes++;
     }
-    if (D != 0) {
-        fprintf(stderr, "Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n", D, EXT2_ROOT_INO);
+    free(links);
+
+    // Reclaim inodes marked in use that have no links and no entry naming
+    // them. Their blocks are then unowned and reclaimed with the other
+    // leaked blocks below.
+    unsigned char *referenced = referenced_inodes();
+    for (i = 1; i <= sb->s_inodes_count; i++) {
+        if (i < EXT2_GOOD_OLD_FIRST_INO || inode_table[i - 1].i_links_count > 0) {
+            referenced[(i - 1) / 8] |= 1 << ((i - 1) % 8);
+        }
     }
-    
-    for (i = 10; i < sb->s_inodes_count; i++) {
-        data_blocks = inode_table[i].i_blocks / 2;
-        if ( inode_table[i].i_blocks / 2 > 12 ) {
-            indirect_block_num = inode_table[i].i_block[12];
-            indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
-            data_blocks--;
+    int leaked_inodes = clear_unreferenced(inode_bitmap, referenced, sb->s_inodes_count);
+    free(referenced);
+
+    // Check for data block allocation for each file, directory and symlink.
+    // One pass over the block -> owner map covers every in-use inode.
+    struct owner_map *map = build_owner_map();
+    int *unmarked = calloc(sb->s_inodes_count + 1, sizeof(int));
+    if (unmarked == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    int block_num;
+    for (block_num = 1; block_num < map->blocks_count; block_num++) {
+        int owner = map->owner[block_num];
+        if (owner > 0 && !is_set(block_bitmap, block_num)) {
+            set_bit(block_bitmap, block_num, BLOCK_BITMAP_SIZE);
+            total_fixes++;
+            unmarked[owner]++;
         }
+    }
+    for (i = 1; i <= sb->s_inodes_count; i++) {
+        if (unmarked[i] != 0) {
+            fprintf(stderr, "Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n",
+                    unmarked[i], i);
+        }
+    }
+    free(unmarked);
 
-        D = 0;
-        for (j = 0; j < data_blocks ; j++) {
-            if (j < 12) {
-                block_num = inode_table[i].i_block[j];
-            } else {
-                indirect_idx = j - 12;
-                memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
-            }
-            if (!is_set(block_bitmap, block_num)) {
-                set_bit(block_bitmap, block_num, 16);
-                total_fixes++;
-                D++;
-            }
+    // Blocks claimed twice cannot be fixed here, only reported
+    for (block_num = 1; block_num < map->blocks_count && map->shared_count > 0; block_num++) {
+        if (map->shared[block_num]) {
+            fprintf(stderr, "Found: block [%d] claimed by more than one inode, first by inode [%d]\n",
+                    block_num, map->owner[block_num]);
         }
-        if (D != 0) {
-        fprintf(stderr, "Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n", D, i + 1);
+    }
+    if (map->bad_count > 0) {
+        fprintf(stderr, "Found: %d block pointers outside the image\n", map->bad_count);
+    }
+
+    // Reclaim blocks marked in use that neither hold metadata nor belong
+    // to any in-use inode. The blocks of an inode whose map cannot be walked
+    // are not in the owner map, so nothing is reclaimed while one exists.
+    int leaked_blocks = 0;
+    if (map->unwalked_count > 0) {
+        fprintf(stderr, "Found: %d in-use inodes with a corrupt block map, leaked blocks not reclaimed\n",
+                map->unwalked_count);
+    } else {
+        referenced = calloc(BLOCK_BITMAP_SIZE + sizeof(unsigned long long), 1);
+        if (referenced == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (block_num = sb->s_first_data_block; block_num < map->blocks_count; block_num++) {
+            if (map->owner[block_num] != OWNER_FREE) {
+                int bit = block_num - sb->s_first_data_block;
+                referenced[bit / 8] |= 1 << (bit % 8);
+            }
         }
+        leaked_blocks = clear_unreferenced(block_bitmap, referenced,
+                                           sb->s_blocks_count - sb->s_first_data_block);
+        free(referenced);
+    }
+    if (leaked_inodes > 0 || leaked_blocks > 0) {
+        fprintf(stderr, "Fixed: reclaimed %d leaked inodes and %d leaked blocks (%d KB)\n",
+                leaked_inodes, leaked_blocks, leaked_blocks * EXT2_BLOCK_SIZE / 1024);
+        total_fixes += leaked_inodes + leaked_blocks;
     }
+    free_owner_map(map);
 
     // Check file_type for each file, directory or symlink
     examine_dir_inode(EXT2_ROOT_INO);
 
     for (i = EXT2_GOOD_OLD_FIRST_INO ; i < sb->s_inodes_count; i++) {
+        if (lazy && !is_set(inode_bitmap, i + 1)) {
+            continue;
+        }
         if (inode_table[i].i_links_count > 0 && IS_S_DIR(i + 1)) {
             examine_dir_inode(i + 1);
         }
@@ -168,33 +208,32 @@ int main(int argc, char **argv) {
     if (inode_table[EXT2_ROOT_INO - 1].i_dtime != 0) {
         fprintf(stderr, "Fixed: valid inode marked for deletion: [%d]\n", EXT2_ROOT_INO);
         inode_table[EXT2_ROOT_INO - 1].i_dtime = 0;
+        update_inode_csum(EXT2_ROOT_INO);
         total_fixes++;
     }
 
     for (i = 10; i < sb->s_inodes_count; i++) {
+        if (lazy && !is_set(inode_bitmap, i + 1)) {
+            continue;
+        }
         if (inode_table[i].i_links_count > 0 && inode_table[i].i_dtime != 0) {
             fprintf(stderr, "Fixed: valid inode marked for deletion: [%d]\n", i + 1);
             inode_table[i].i_dtime = 0;
+            update_inode_csum(i + 1);
             total_fixes++;
         }
     }
 
+    // Check the metadata checksums, if the image has them
+    total_fixes += examine_csums();
+
     if (total_fixes == 0) {
         printf("No file system inconsistencies detected!\n");
     } else if (total_fixes > 0) {
         printf("%d file system inconsistencies repaired!\n", total_fixes);
     }
 
-    if (close(fd) == -1) {
-        perror("close");
-        exit(1);
-    }
-
-    int ret = munmap(disk, 128 * 1024);
-    if (ret == -1) {
-        perror("munmap");
-        exit(1);
-    }
+    close_image();
     /******************************************************************
 	 * End
 	 ******************************************************************/
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <libgen.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    if(argc != 3) {
+        fprintf(stderr, "Usage: %s <image file name> <absolute path to directory | -a>\n", argv[0]);
+        exit(1);
+    }
+    open_image(argv[1]);
+
+    /******************************************************************
+	 * Compact
+	 ******************************************************************/
+    stats_phase("compact");
+    int freed = 0;
+    if (strcmp(argv[2], "-a") == 0) {
+        // Whole image: the root directory and every in-use directory
+        freed += compact_dir(EXT2_ROOT_INO);
+        for (int i = EXT2_GOOD_OLD_FIRST_INO; i < sb->s_inodes_count; i++) {
+            if (is_set(inode_bitmap, i + 1) && inode_table[i].i_links_count > 0 && IS_S_DIR(i + 1)) {
+                freed += compact_dir(i + 1);
+            }
+        }
+    } else {
+        char *path = argv[2];
+        validate_path(path, ABS_PATH);
+        char* name = basename(path);
+
+        int prev_inode;
+        int inode = inode_num(path, &prev_inode);
+        if (!inode) {
+            fprintf(stderr, "ERROR: file or directory %s does not exist.\n", name);
+            exit(ENOENT);
+        } else if (!IS_S_DIR(inode)) {
+            fprintf(stderr, "ERROR: %s is not a directory\n", name);
+            exit(ENOTDIR);
+        }
+        freed += compact_dir(inode);
+    }
+    printf("%d directory blocks released\n", freed);
+
+    close_image();
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return 0;
+}
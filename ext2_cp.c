@@ -8,51 +8,517 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <libgen.h>
-#include <sys/stat.h>
+#include <pthread.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
 
-int main(int argc, char **argv) {
-    
-    if(argc <= 3) {
-        fprintf(stderr, "Usage: %s <image file name> <native path to source file> <absolute path to directory>\n", argv[0]);
-        exit(1);
+// One source of a multi-file copy. The metadata pass allocates its inode
+// and blocks, the data pass fills the blocks in.
+struct cp_job {
+    char *source;
+    char *name;
+    unsigned int size;
+    int blocks;         // data blocks
+    int *list;          // i_block[0..11], the indirect block, then the rest
+    int inode;
+    int error;          // errno the data pass failed with, or 0
+};
+
+// The data pass hands out jobs in order through next
+struct cp_pool {
+    struct cp_job *jobs;
+    int *order;
+    int count;
+    int next;
+};
+
+static void cp_usage(char *prog) {
+    fprintf(stderr, "Usage: %s <image file name> [OPTIONAL -l file list] <native path to source file, "
+            "or - for stdin>... <absolute path to directory>\n", prog);
+    exit(1);
+}
+
+static void cp_add_source(struct cp_job **jobs, int *count, int *capacity, char *source) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *jobs = realloc(*jobs, *capacity * sizeof(struct cp_job));
+        if (*jobs == NULL) {
+            perror("realloc");
+            exit(1);
+        }
     }
-    int fd = open(argv[1], O_RDWR);
+    memset(&(*jobs)[*count], 0, sizeof(struct cp_job));
+    (*jobs)[(*count)++].source = source;
+}
+
+static int cp_compare_name(const void *a, const void *b) {
+    return strcmp(((struct cp_job *)a)->name, ((struct cp_job *)b)->name);
+}
+
+// Largest first
+static int cp_compare_size(const void *a, const void *b) {
+    unsigned int x = ((struct cp_job *)a)->size;
+    unsigned int y = ((struct cp_job *)b)->size;
+    return (x < y) - (x > y);
+}
+
+// Take count free blocks into list, in one run when the bitmap has one
+// at or after goal, which then moves past it.
+static void cp_take_blocks(int count, int *goal, int *list) {
+    bitmap_lock(block_bitmap);
+    int start = count ? find_free_run(count, *goal) : 0;
+    if (start) {
+        set_bit_range(block_bitmap, start, count, BLOCK_BITMAP_SIZE);
+        for (int i = 0; i < count; i++) {
+            list[i] = start + i;
+        }
+        *goal = start + count;
+    } else {
+        for (int i = 0; i < count; i++) {
+            list[i] = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
+        }
+    }
+    bitmap_unlock(block_bitmap);
+}
+
+// Take the blocks of a job and point the inode and its indirect block
+// at them.
+static void cp_reserve(struct cp_job *job, int inode, int *goal) {
+    int total = job->blocks + (job->blocks > 12);
+    cp_take_blocks(total, goal, job->list);
+
+    for (int i = 0; i < total && i <= 12; i++) {
+        inode_table[inode - 1].i_block[i] = job->list[i];
+    }
+    if (total > 12) {
+        unsigned char *indirect_block = get_new_block(job->list[12]);
+        memcpy(indirect_block, &job->list[13], (total - 13) * sizeof(int));
+        mark_dirty(job->list[12]);
+    }
+}
+
+// Copy the contents of a job into its reserved blocks. Workers must not
+// exit, so a failure is only recorded in the job for the main thread.
+static void cp_copy_data(struct cp_job *job) {
+    int fd = open(job->source, O_RDONLY);
     if (fd == -1) {
-        perror("open");
+        fprintf(stderr, "ERROR: cannot open %s\n", job->source);
+        job->error = ENOENT;
+        return;
+    }
+    for (int i = 0; i < job->blocks; i++) {
+        int block = job->list[i < 12 ? i : i + 1];
+        unsigned char *data = get_new_block(block);
+        unsigned int offset = i * EXT2_BLOCK_SIZE;
+        int bytes = job->size - offset < EXT2_BLOCK_SIZE ? job->size - offset : EXT2_BLOCK_SIZE;
+        if (pread(fd, data, bytes, offset) != bytes) {
+            fprintf(stderr, "ERROR: cannot read %s\n", job->source);
+            job->error = EIO;
+            break;
+        }
+        mark_dirty(block);
+    }
+    close(fd);
+}
+
+static void *cp_worker(void *arg) {
+    struct cp_pool *pool = arg;
+    int k;
+    while ((k = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        cp_copy_data(&pool->jobs[pool->order[k]]);
+    }
+    return NULL;
+}
+
+// The reader thread of a single copy fills the slots of the ring from the
+// source while the writer moves the slots before them into the image.
+struct cp_ring {
+    int fd;
+    unsigned char *buf;         // CP_RING_SLOTS slots of CP_SLOT_BLOCKS blocks
+    int len[CP_RING_SLOTS];     // bytes read into each slot
+    long filled;                // slots handed to the writer so far
+    long drained;               // slots the writer is done with
+    int done;                   // no slots come after filled
+    int error;                  // errno of a failed read
+    int stop;                   // the writer gave up, read no more
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Every slot but the last is read full, so only the last block of the
+// source can be partial. The reader can only be cancelled while it waits
+// in read, as on a pipe that has nothing more to give yet.
+static void *cp_reader(void *arg) {
+    struct cp_ring *ring = arg;
+    int slot_size = CP_SLOT_BLOCKS * EXT2_BLOCK_SIZE;
+    ssize_t n = 1;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (n > 0) {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->filled - ring->drained == CP_RING_SLOTS && !ring->stop) {
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        }
+        if (ring->stop) {
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+        int slot = ring->filled % CP_RING_SLOTS;
+        pthread_mutex_unlock(&ring->lock);
+
+        unsigned char *buf = ring->buf + slot * slot_size;
+        int len = 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        while (len < slot_size && (n = read(ring->fd, buf + len, slot_size - len)) != 0) {
+            if (n == -1 && errno != EINTR) {
+                break;
+            }
+            len += n > 0 ? n : 0;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&ring->lock);
+        ring->len[slot] = len;
+        if (len > 0) {
+            ring->filled++;
+        }
+        if (n <= 0) {
+            ring->done = 1;
+            ring->error = n == -1 ? errno : 0;
+        }
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return NULL;
+}
+
+// Stop the reader thread, wait for it and free the ring. Also run before
+// any abort, so no thread is left reading into a ring that is gone.
+static void cp_stop_reader(struct cp_ring *ring, pthread_t reader) {
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = 1;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_cancel(reader);
+    pthread_join(reader, NULL);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->cond);
+    free(ring->buf);
+}
+
+// Give back everything a failed single copy took, then exit with err
+static void cp_abort(int inode, int *list, int taken, int err) {
+    unset_block_list(list, taken);
+    unset_bit(inode_bitmap, inode, INODE_BITMAP_SIZE);
+    memset(&inode_table[inode - 1], 0, sizeof(struct ext2_inode));
+    update_inode_csum(inode);
+    close_image();
+    exit(err);
+}
+
+// cp_pipeline copies fd to the end into new blocks of inode, growing the
+// block map a slot at a time, and fills list as inode_block_list would.
+// A reader thread keeps up to CP_RING_SLOTS slots read ahead, so the source
+// is read while the image is written. It returns the number of data blocks
+// and sets size to the bytes copied.
+static int cp_pipeline(int fd, int inode, int *list, unsigned int *size) {
+    struct cp_ring ring = { .fd = fd };
+    ring.buf = malloc(CP_RING_SLOTS * CP_SLOT_BLOCKS * EXT2_BLOCK_SIZE);
+    if (ring.buf == NULL) {
+        perror("malloc");
         exit(1);
     }
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.cond, NULL);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, cp_reader, &ring) != 0) {
+        perror("pthread_create");
+        free(ring.buf);
+        cp_abort(inode, list, 0, 1);
+    }
+
+    int blocks = 0;     // data blocks copied
+    int taken = 0;      // entries of list, the indirect block included
+    int goal = 0;
+    for (;;) {
+        pthread_mutex_lock(&ring.lock);
+        while (ring.filled == ring.drained && !ring.done) {
+            pthread_cond_wait(&ring.cond, &ring.lock);
+        }
+        if (ring.filled == ring.drained) {
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+        int slot = ring.drained % CP_RING_SLOTS;
+        int len = ring.len[slot];
+        pthread_mutex_unlock(&ring.lock);
+
+        // The indirect block is taken along with block 12
+        int n = (len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+        int need = n + (blocks <= 12 && blocks + n > 12);
+        if (blocks + n > 12 + EXT2_BLOCK_SIZE / 4) {
+            cp_stop_reader(&ring, reader);
+            fprintf(stderr, "ERROR: source file is too large\n");
+            cp_abort(inode, list, taken, EFBIG);
+        }
+        if (need > gd->bg_free_blocks_count) {
+            cp_stop_reader(&ring, reader);
+            fprintf(stderr, "ERROR: Not enough space in the file system\n");
+            cp_abort(inode, list, taken, ENOSPC);
+        }
+        cp_take_blocks(need, &goal, list + taken);
+        taken += need;
+
+        unsigned char *buf = ring.buf + slot * CP_SLOT_BLOCKS * EXT2_BLOCK_SIZE;
+        for (int i = 0; i < n; i++) {
+            int block = list[blocks + i < 12 ? blocks + i : blocks + i + 1];
+            int bytes = len - i * EXT2_BLOCK_SIZE;
+            // Fresh blocks are not read from the image, only written back
+            memcpy(get_new_block(block), buf + i * EXT2_BLOCK_SIZE,
+                   bytes < EXT2_BLOCK_SIZE ? bytes : EXT2_BLOCK_SIZE);
+            mark_dirty(block);
+        }
+        for (int i = blocks; i < taken && i <= 12; i++) {
+            inode_table[inode - 1].i_block[i] = list[i];
+        }
+        if (taken > 12) {
+            unsigned char *indirect_block = blocks <= 12 ? get_new_block(list[12]) : get_block(list[12]);
+            memcpy(indirect_block, &list[13], (taken - 13) * sizeof(int));
+            mark_dirty(list[12]);
+        }
+        blocks += n;
+        *size += len;
+
+        pthread_mutex_lock(&ring.lock);
+        ring.drained++;
+        pthread_cond_broadcast(&ring.cond);
+        pthread_mutex_unlock(&ring.lock);
+    }
+    cp_stop_reader(&ring, reader);
+    if (ring.error) {
+        fprintf(stderr, "ERROR: cannot read the source file: %s\n", strerror(ring.error));
+        cp_abort(inode, list, taken, EIO);
+    }
+    return blocks;
+}
+
+// cp_many copies several sources into one directory. Everything is checked
+// before the image is touched; then the inodes, blocks and dir entries are
+// allocated on this thread and the data is copied by a pool of workers.
+static void cp_many(int argc, char **argv) {
+    struct cp_job *jobs = NULL;
+    int count = 0;
+    int capacity = 0;
+    int first = 2;
+    if (strcmp(argv[2], "-l") == 0) {
+        if (argc < 5) {
+            cp_usage(argv[0]);
+        }
+        FILE *list_fp = fopen(argv[3], "r");
+        if (list_fp == NULL) {
+            fprintf(stderr, "ERROR: file list %s does not exist.\n", argv[3]);
+            exit(ENOENT);
+        }
+        char *line = NULL;
+        size_t line_size = 0;
+        while (getline(&line, &line_size, list_fp) != -1) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] != '\0') {
+                cp_add_source(&jobs, &count, &capacity, strdup(line));
+            }
+        }
+        free(line);
+        fclose(list_fp);
+        first = 4;
+    }
+    for (int i = first; i < argc - 1; i++) {
+        cp_add_source(&jobs, &count, &capacity, argv[i]);
+    }
+    if (count == 0) {
+        cp_usage(argv[0]);
+    }
+    open_image(argv[1]);
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
+    char *path = argv[argc - 1];
+    validate_path(path, ABS_PATH);
+    int prev_inode;
+    int location = inode_num(path, &prev_inode);
+    if (!location || !IS_S_DIR(location)) {
+        fprintf(stderr, "ERROR: %s is not a directory.\n", path);
+        exit(ENOENT);
+    }
+
+    /******************************************************************
+	 * Check every source
+	 ******************************************************************/
+    stats_phase("check");
+    // Hold the directory until every entry is in it, so no other process
+    // adds one of the names after it has been checked.
+    dir_write_lock(location);
+    int blocks_needed = 0;
+    for (int i = 0; i < count; i++) {
+        struct cp_job *job = &jobs[i];
+        // Opened here so an unreadable source fails before anything is
+        // allocated
+        struct stat st;
+        int fd = open(job->source, O_RDONLY);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            if (errno == ENOENT) {
+                fprintf(stderr, "ERROR: source file %s does not exist.\n", job->source);
+            } else {
+                fprintf(stderr, "ERROR: cannot open %s\n", job->source);
+            }
+            exit(ENOENT);
+        }
+        close(fd);
+        validate_path(job->source, REG_PATH);
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "ERROR: source file %s is not a regular file.\n", job->source);
+            exit(EINVAL);
+        }
+        job->name = basename(strdup(job->source));
+        job->size = st.st_size;
+        job->blocks = (job->size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+        if (job->blocks > 12 + EXT2_BLOCK_SIZE / 4) {
+            fprintf(stderr, "ERROR: source file %s is too large\n", job->source);
+            exit(EFBIG);
+        }
+        if (check_exist(job->name, location)) {
+            fprintf(stderr, "ERROR: file or directory %s already exists.\n", job->name);
+            exit(EEXIST);
+        }
+        blocks_needed += job->blocks + (job->blocks > 12);
+    }
+    qsort(jobs, count, sizeof(struct cp_job), cp_compare_name);
+    for (int i = 1; i < count; i++) {
+        if (strcmp(jobs[i - 1].name, jobs[i].name) == 0) {
+            fprintf(stderr, "ERROR: file or directory %s already exists.\n", jobs[i].name);
+            exit(EEXIST);
+        }
+    }
+    if (count > gd->bg_free_inodes_count || blocks_needed > gd->bg_free_blocks_count) {
+        fprintf(stderr, "ERROR: Not enough space in the file system\n");
+        exit(ENOSPC);
+    }
+
+    /******************************************************************
+	 * Allocate the inodes, blocks and dir entries
+	 ******************************************************************/
+    stats_phase("allocate");
+    int goal = 0;
+    for (int i = 0; i < count; i++) {
+        struct cp_job *job = &jobs[i];
+        job->list = malloc((job->blocks + 1) * sizeof(int));
+        if (job->list == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        int new_inode_num = find_next_available(inode_bitmap, INODE_BITMAP_SIZE);
+        job->inode = new_inode_num;
+        inode_table[new_inode_num - 1].i_mode = EXT2_S_IFREG;
+        inode_table[new_inode_num - 1].i_size = job->size;
+        inode_table[new_inode_num - 1].i_links_count = 1;
+        inode_table[new_inode_num - 1].i_blocks = (job->blocks + (job->blocks > 12)) * 2;
+        cp_reserve(job, new_inode_num, &goal);
+        update_inode_csum(new_inode_num);
+        insert_dir_entry(new_inode_num, job->name, location, EXT2_FT_REG_FILE);
+    }
+    dir_unlock(location);
+
+    /******************************************************************
+	 * Copy the data
+	 ******************************************************************/
+    stats_phase("copy");
+    // Alternate the largest and smallest remaining files, so the small
+    // ones keep idle workers busy while the large ones are copied.
+    qsort(jobs, count, sizeof(struct cp_job), cp_compare_size);
+    struct cp_pool pool = { jobs, malloc(count * sizeof(int)), count, 0 };
+    if (pool.order == NULL) {
+        perror("malloc");
         exit(1);
     }
+    int large = 0;
+    int small = count - 1;
+    for (int i = 0; i < count; i++) {
+        pool.order[i] = i % 2 ? small-- : large++;
+    }
+
+    int threads = worker_threads(count, CP_PARALLEL_MIN);
+    if (threads > count) {
+        threads = count;
+    }
+    // The workers only fill blocks allocated above, so they need no
+    // allocator state, just a backend that can be shared between threads
+    if (threads > 1 && io_thread_safe()) {
+        pthread_t tids[HELPER_MAX_THREADS];
+        int started = 0;
+        while (started < threads && pthread_create(&tids[started], NULL, cp_worker, &pool) == 0) {
+            started++;
+        }
+        // Whatever no thread could be started for is copied here
+        cp_worker(&pool);
+        for (int i = 0; i < started; i++) {
+            pthread_join(tids[i], NULL);
+        }
+    } else {
+        cp_worker(&pool);
+    }
+    free(pool.order);
 
-    // Initalize the global variables
-    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
-    block_bitmap = disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE;
-    inode_bitmap = disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE;
-    inode_table = (struct ext2_inode *)(disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    // A file whose data could not be copied holds garbage, so it is
+    // unlinked again, which frees its inode and blocks
+    int error = 0;
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].error) {
+            remove_dir_entry(jobs[i].inode, jobs[i].name, location);
+            error = error ? error : jobs[i].error;
+        }
+        free(jobs[i].list);
+    }
+    free(jobs);
+
+    close_image();
+    if (error) {
+        exit(error);
+    }
+}
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    trace_op(argc, argv);
+    
+    if(argc <= 3) {
+        cp_usage(argv[0]);
+    }
+    share_image();
+    if (argc > 4 || strcmp(argv[2], "-l") == 0) {
+        cp_many(argc, argv);
+        return 0;
+    }
+    open_image(argv[1]);
 
     char *source = argv[2];
-    if( access( source, F_OK ) == -1 ) {
+    int from_stdin = strcmp(source, "-") == 0;
+    if (!from_stdin && access( source, F_OK ) == -1 ) {
         fprintf(stderr, "ERROR: source file %s does not exist.\n", source);
         exit(ENOENT);
     }
     char *source_filename = basename(source);
     char *path = argv[3];
     char *target_filename = basename(path);
-    validate_path(source, REG_PATH);
+    if (!from_stdin) {
+        validate_path(source, REG_PATH);
+    }
     validate_path(path, ABS_PATH);
     int prev_inode;
     int last = inode_num(path, &prev_inode);
     char* curr;
     int location;
 
-    if (last && IS_S_DIR(last)) {
+    if (last && IS_S_DIR(last) && from_stdin) {
+        fprintf(stderr, "ERROR: stdin needs a file name in %s\n", path);
+        exit(EINVAL);
+    } else if (last && IS_S_DIR(last)) {
         int already_exist = check_exist(source_filename, last);
         if (already_exist) {
             fprintf(stderr, "ERROR: file or directory %s already exists.\n", source_filename);
@@ -71,95 +537,54 @@ int main(int argc, char **argv) {
     /******************************************************************
 	 * Copy the source file to dest
 	 ******************************************************************/
+    stats_phase("copy");
             
-    FILE* fp = fopen(argv[2], "r");
-    if (fp == NULL) {
-        fprintf(stderr, "ERROR: fopen.\n");
-        exit(EEXIST);
-    }
+    int fd = STDIN_FILENO;
+    if (!from_stdin) {
+        fd = open(source, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "ERROR: open.\n");
+            exit(EEXIST);
+        }
 
-    // Get the file size
-    struct stat st;
-    stat(argv[2], &st);
-    unsigned int file_size = st.st_size;
-    
-    // See if the filesystem has enough space for the source file
-    int block_required;
-    if (file_size % EXT2_BLOCK_SIZE == 0) {
-        block_required = file_size / EXT2_BLOCK_SIZE;
-    } else {
-        block_required = (file_size + EXT2_BLOCK_SIZE - (file_size % EXT2_BLOCK_SIZE)) / EXT2_BLOCK_SIZE;
-    }
-            
-    if (block_required > gd->bg_free_blocks_count) {
-        fprintf(stderr, "ERROR: Not enough space in the file system\n");
-        exit(ENOENT);
+        // See if the filesystem has enough space for the source file
+        struct stat st;
+        fstat(fd, &st);
+        int block_required = (st.st_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+        if (block_required > gd->bg_free_blocks_count) {
+            fprintf(stderr, "ERROR: Not enough space in the file system\n");
+            exit(ENOENT);
+        }
     }
     
-    // Find a new inode num for this file
+    // Find a new inode num for this file. It is linked in once the whole
+    // source has been copied.
     int new_inode_num = find_next_available(inode_bitmap, INODE_BITMAP_SIZE);
-    inode_table[new_inode_num - 1].i_mode = 0;
-    inode_table[new_inode_num - 1].i_mode |= EXT2_S_IFREG;
-    inode_table[new_inode_num - 1].i_uid = 0;
-    inode_table[new_inode_num - 1].i_size = file_size;
-    inode_table[new_inode_num - 1].i_ctime = 0;
-    inode_table[new_inode_num - 1].i_dtime = 0;
-    inode_table[new_inode_num - 1].i_gid = 0;
+    inode_table[new_inode_num - 1].i_mode = EXT2_S_IFREG;
     inode_table[new_inode_num - 1].i_links_count = 1;
-    // If block_required is greater than 11, it means that indirect block is needed.
-    if (block_required >= 12) {
-        inode_table[new_inode_num - 1].i_blocks = (block_required + 1) * 2;
-    } else {
-        inode_table[new_inode_num - 1].i_blocks = block_required * 2;
-    }
-    inode_table[new_inode_num - 1].osd1 = 0;
-    inode_table[new_inode_num - 1].i_generation = 0;
-    inode_table[new_inode_num - 1].i_file_acl = 0;
-    inode_table[new_inode_num - 1].i_dir_acl = 0;
-    inode_table[new_inode_num - 1].i_faddr = 0;
 
-    insert_dir_entry(new_inode_num, curr, location, EXT2_FT_REG_FILE);
-    int new_block_num;
-    int indirect_block_num;
-    int indirect_idx;
-    struct ext2_dir_entry *data;
-    unsigned char* indirect_block;
-
-    // Copy the file data to the filesystem block by block.
-    for (int i = 0; i < block_required; i++) {
-        if ( i < 12) {
-            new_block_num = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
-            inode_table[new_inode_num - 1].i_block[i] = new_block_num;
-        } else if ( i == 12) {
-            indirect_block_num = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
-            inode_table[new_inode_num - 1].i_block[i] = indirect_block_num;
-            new_block_num = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
-            indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
-            memcpy(indirect_block, &new_block_num, sizeof(int));
-        } else {
-            indirect_idx = i - 12;
-            new_block_num = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
-            memcpy(indirect_block + (4 * indirect_idx), &new_block_num, sizeof(int));
-        }
-
-        data = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * new_block_num);
-        if ((file_size % EXT2_BLOCK_SIZE) != 0 && i == block_required - 1) {
-            fread(data, file_size % EXT2_BLOCK_SIZE, 1, fp);
-        } else {
-            fread(data, EXT2_BLOCK_SIZE, 1, fp);
-        }
-    }   
-    
-    if (close(fd) == -1) {
-        perror("close");
-        exit(1);
+    int list[INODE_LIST_MAX];
+    unsigned int file_size = 0;
+    int blocks = cp_pipeline(fd, new_inode_num, list, &file_size);
+    inode_table[new_inode_num - 1].i_size = file_size;
+    // If more than 12 blocks are used, an indirect block is needed too
+    inode_table[new_inode_num - 1].i_blocks = (blocks + (blocks > 12)) * 2;
+    update_inode_csum(new_inode_num);
+    // Another process may have taken the name while the data was copied
+    dir_write_lock(location);
+    if (check_exist(curr, location)) {
+        fprintf(stderr, "ERROR: file or directory %s already exists.\n", curr);
+        cp_abort(new_inode_num, list, blocks + (blocks > 12), EEXIST);
     }
-
-    int ret = munmap(disk, 128 * 1024);
-    if (ret == -1) {
-        perror("munmap");
-        exit(1);
+    insert_dir_entry(new_inode_num, curr, location, EXT2_FT_REG_FILE);
+    dir_unlock(location);
+    if (!from_stdin) {
+        close(fd);
+    } else {
+        trace_copied(file_size);
     }
+    
+    close_image();
     /******************************************************************
 	 * End
 	 ******************************************************************/
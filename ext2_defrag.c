@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+// Append the inodes of every entry in dir_inode to order, skipping "." / ".."
+// and inodes that are already queued (hard links).
+// It returns the new length of order.
+int queue_dir_entries(int dir_inode, int* order, int n, char* seen) {
+    int list[INODE_LIST_MAX];
+    int blocks = inode_block_list(dir_inode, list);
+
+    for (int i = 0; i < blocks; i++) {
+        // The indirect block holds block numbers, not entries
+        if (blocks > 12 && i == 12) {
+            continue;
+        }
+        unsigned char *block = get_block(list[i]);
+        struct ext2_dir_entry *entry;
+        int rec_len = 0;
+        while (rec_len < EXT2_BLOCK_SIZE) {
+            entry = (struct ext2_dir_entry *)(block + rec_len);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            rec_len += entry->rec_len;
+            if (entry->inode == 0 || seen[entry->inode - 1]) {
+                continue;
+            }
+            if ((entry->name_len == 1 && strncmp(entry->name, ".", 1) == 0) ||
+                (entry->name_len == 2 && strncmp(entry->name, "..", 2) == 0)) {
+                continue;
+            }
+            seen[entry->inode - 1] = 1;
+            order[n++] = entry->inode;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    if(argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <image file name> [OPTIONAL -n | -l]\n", argv[0]);
+        exit(1);
+    }
+    int dry_run = 0;
+    int locality = 0;
+    if (argc == 3 && strcmp(argv[2], "-n") == 0) {
+        dry_run = 1;
+    } else if (argc == 3 && strcmp(argv[2], "-l") == 0) {
+        locality = 1;
+    } else if (argc == 3) {
+        fprintf(stderr, "Usage: %s <image file name> [OPTIONAL -n | -l]\n", argv[0]);
+        exit(1);
+    }
+
+    open_image(argv[1]);
+
+    /******************************************************************
+	 * Order the inodes for locality
+	 ******************************************************************/
+    stats_phase("order");
+    // Breadth-first over the directory tree: each directory is followed by
+    // the files it contains, so a directory and its files end up close
+    // together once they are laid out in this order.
+    int *order = malloc(sb->s_inodes_count * sizeof(int));
+    char *seen = calloc(sb->s_inodes_count, 1);
+    if (order == NULL || seen == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int n = 0;
+    order[n++] = EXT2_ROOT_INO;
+    seen[EXT2_ROOT_INO - 1] = 1;
+    for (int head = 0; head < n; head++) {
+        if (IS_S_DIR(order[head])) {
+            n = queue_dir_entries(order[head], order, n, seen);
+        }
+    }
+
+    /******************************************************************
+	 * Defragment
+	 ******************************************************************/
+    stats_phase("defrag");
+    int before = 0;
+    int after = 0;
+    int moved = 0;
+    int goal = 0;
+    int list[INODE_LIST_MAX];
+    for (int i = 0; i < n; i++) {
+        int inode = order[i];
+        int blocks = inode_block_list(inode, list);
+        if (blocks <= 0) {
+            continue;
+        }
+        int fragments = count_fragments(inode);
+        before += fragments;
+
+        int start = 0;
+        if (!dry_run) {
+            start = find_free_run(blocks, goal);
+        }
+
+        // Contiguous files stay where they are, unless locality was asked for
+        // and there is a free run between the goal and their current spot.
+        if (dry_run || (fragments == 1 && (!locality || start == 0 || start < goal || start > list[0]))) {
+            if (fragments > 1) {
+                printf("inode [%d]: %d blocks in %d fragments\n", inode, blocks, fragments);
+            }
+            after += fragments;
+            goal = list[blocks - 1] + 1;
+            continue;
+        }
+
+        if (start == 0) {
+            fprintf(stderr, "WARNING: no free run of %d blocks for inode [%d]\n", blocks, inode);
+            after += fragments;
+            continue;
+        }
+        relocate_inode(inode, start);
+        moved++;
+        after += count_fragments(inode);
+        goal = start + blocks;
+    }
+
+    printf("%d inodes, %d fragments before, %d fragments after, %d inodes moved\n", n, before, after, moved);
+    free(order);
+    free(seen);
+
+    close_image();
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return 0;
+}
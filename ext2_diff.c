@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+// Blocks are compared DIFF_VEC_LANES vectors at a time. The vector type
+// compiles to whatever SIMD registers the target has.
+typedef unsigned long long diff_vec __attribute__((vector_size(32), may_alias));
+#define DIFF_VEC_LANES 4
+
+// One side of the diff. disk is a read-only mapping of its own, used for
+// the block compare; the rest is filled in from the image opened the
+// usual way.
+struct diff_image {
+    char *path;
+    unsigned char *disk;
+    long long size;
+    struct ext2_super_block *sb;
+    struct ext2_group_desc *gd;
+    unsigned char *in_use;      // per inode
+    unsigned char *is_dir;      // per inode
+    char **path_of;             // per inode, one path naming it, or NULL
+    struct tree_entry *entries;
+    int entry_count;
+};
+
+// A line of the report
+struct diff_change {
+    char kind;                  // A(dded), D(eleted) or M(odified)
+    int inode;
+    int dir;
+    char *path;
+};
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONAL -b changed block list, or - for stdin] <old image file name> "
+            "<new image file name>\n", prog);
+    exit(1);
+}
+
+static void map_diff_image(struct diff_image *image, char *path) {
+    memset(image, 0, sizeof(*image));
+    image->path = path;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    image->size = st.st_size;
+    if (image->size < 3 * EXT2_BLOCK_SIZE) {
+        fprintf(stderr, "ERROR: %s is not an ext2 image\n", path);
+        exit(EINVAL);
+    }
+    image->disk = mmap(NULL, image->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (image->disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    image->sb = (struct ext2_super_block *)(image->disk + EXT2_BLOCK_SIZE);
+    image->gd = (struct ext2_group_desc *)(image->disk + 2 * EXT2_BLOCK_SIZE);
+    if (image->sb->s_magic != EXT2_SUPER_MAGIC
+        || (long long)image->sb->s_blocks_count * EXT2_BLOCK_SIZE > image->size) {
+        fprintf(stderr, "ERROR: %s is not an ext2 image\n", path);
+        exit(EINVAL);
+    }
+}
+
+static int same_geometry(struct diff_image *a, struct diff_image *b) {
+    return a->sb->s_blocks_count == b->sb->s_blocks_count && a->sb->s_inodes_count == b->sb->s_inodes_count
+           && a->sb->s_first_data_block == b->sb->s_first_data_block
+           && a->gd->bg_block_bitmap == b->gd->bg_block_bitmap
+           && a->gd->bg_inode_bitmap == b->gd->bg_inode_bitmap
+           && a->gd->bg_inode_table == b->gd->bg_inode_table;
+}
+
+// blocks_differ ORs the XOR of the two blocks a few vectors at a time, so
+// equal blocks cost one pass with no branch per byte.
+static int blocks_differ(const unsigned char *a, const unsigned char *b) {
+    const diff_vec *x = (const diff_vec *)a;
+    const diff_vec *y = (const diff_vec *)b;
+    int vectors = EXT2_BLOCK_SIZE / sizeof(diff_vec);
+    for (int i = 0; i < vectors; i += DIFF_VEC_LANES) {
+        diff_vec d = (x[i] ^ y[i]) | (x[i + 1] ^ y[i + 1]) | (x[i + 2] ^ y[i + 2]) | (x[i + 3] ^ y[i + 3]);
+        if ((d[0] | d[1] | d[2] | d[3]) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Read the block numbers of a hint into changed, a bitmap of blocks to
+// compare
+static void read_hint(char *hint, unsigned char *changed, int blocks_count) {
+    FILE *f = strcmp(hint, "-") == 0 ? stdin : fopen(hint, "r");
+    if (f == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    long block;
+    while (fscanf(f, "%ld", &block) == 1) {
+        if (block > 0 && block < blocks_count) {
+            changed[block / 8] |= 1 << (block % 8);
+        }
+    }
+    if (!feof(f)) {
+        fprintf(stderr, "ERROR: %s is not a list of block numbers\n", hint);
+        exit(EINVAL);
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+}
+
+// Fill in an image's view of its inodes: whether each is in use, whether
+// it is a directory and a path naming it. Blocks flagged in owned are
+// looked up in the image's owner map and their owners flagged in interest.
+static void scan_image(struct diff_image *image, unsigned char *interest, unsigned char *owned, int owned_count) {
+    open_image_readonly(image->path);
+    int inodes_count = sb->s_inodes_count;
+    image->in_use = calloc(inodes_count + 1, 1);
+    image->is_dir = calloc(inodes_count + 1, 1);
+    image->path_of = calloc(inodes_count + 1, sizeof(char *));
+    if (image->in_use == NULL || image->is_dir == NULL || image->path_of == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    unsigned int generation;
+    do {
+        generation = read_begin();
+        if (owned_count > 0) {
+            struct owner_map *map = build_owner_map();
+            for (int b = 1; b < map->blocks_count; b++) {
+                if ((owned[b / 8] & (1 << (b % 8))) && map->owner[b] > 0) {
+                    interest[map->owner[b]] = 1;
+                }
+            }
+            free_owner_map(map);
+        }
+        for (int i = 1; i <= inodes_count; i++) {
+            image->in_use[i] = i == EXT2_ROOT_INO || inode_in_use(i);
+            image->is_dir[i] = image->in_use[i] && inode_type(i) == EXT2_FT_DIR;
+        }
+        free_tree(image->entries, image->entry_count);
+        image->entry_count = walk_tree("/", EXT2_ROOT_INO, &image->entries);
+        memset(image->path_of, 0, (inodes_count + 1) * sizeof(char *));
+        for (int k = 0; k < image->entry_count; k++) {
+            struct tree_entry *entry = &image->entries[k];
+            if (image->path_of[entry->inode] == NULL) {
+                image->path_of[entry->inode] = entry->path;
+            }
+        }
+    } while (read_retry(generation));
+    close_image();
+}
+
+static void free_diff_image(struct diff_image *image) {
+    free(image->in_use);
+    free(image->is_dir);
+    free(image->path_of);
+    free_tree(image->entries, image->entry_count);
+}
+
+static void add_change(struct diff_change **changes, int *count, char kind, int inode, struct diff_image *image) {
+    *changes = realloc(*changes, (*count + 1) * sizeof(struct diff_change));
+    if (*changes == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    struct diff_change *change = &(*changes)[(*count)++];
+    change->kind = kind;
+    change->inode = inode;
+    change->dir = image->is_dir[inode];
+    change->path = image->path_of[inode];
+}
+
+// By path, unnamed inodes last
+static int compare_change(const void *a, const void *b) {
+    const struct diff_change *x = a;
+    const struct diff_change *y = b;
+    if (x->path == NULL || y->path == NULL) {
+        return (x->path == NULL) - (y->path == NULL);
+    }
+    int order = strcmp(x->path, y->path);
+    return order != 0 ? order : x->kind - y->kind;
+}
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    char *hint = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        switch (opt) {
+        case 'b':
+            hint = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2) {
+        usage(argv[0]);
+    }
+    struct diff_image old_image;
+    struct diff_image new_image;
+    map_diff_image(&old_image, argv[optind]);
+    map_diff_image(&new_image, argv[optind + 1]);
+    if (!same_geometry(&old_image, &new_image)) {
+        fprintf(stderr, "ERROR: %s and %s do not have the same geometry\n", argv[optind], argv[optind + 1]);
+        exit(EINVAL);
+    }
+
+    /******************************************************************
+	 * Compare blocks
+	 ******************************************************************/
+    stats_phase("compare");
+    int blocks_count = new_image.sb->s_blocks_count;
+    int inodes_count = new_image.sb->s_inodes_count;
+    int table = new_image.gd->bg_inode_table;
+    int table_end = table + (inodes_count * sizeof(struct ext2_inode) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    // Block 0 is skipped: past the boot code it only holds the writer
+    // generation counters.
+    unsigned char *changed = calloc(blocks_count / 8 + 1, 1);
+    unsigned char *owned = calloc(blocks_count / 8 + 1, 1);
+    unsigned char *interest = calloc(inodes_count + 1, 1);
+    if (changed == NULL || owned == NULL || interest == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (hint != NULL) {
+        read_hint(hint, changed, blocks_count);
+    } else {
+        memset(changed, 0xFF, blocks_count / 8 + 1);
+    }
+    int differing = 0;
+    int owned_count = 0;
+    for (int b = 1; b < blocks_count; b++) {
+        if (!(changed[b / 8] & (1 << (b % 8)))) {
+            continue;
+        }
+        unsigned char *x = old_image.disk + (long long)b * EXT2_BLOCK_SIZE;
+        unsigned char *y = new_image.disk + (long long)b * EXT2_BLOCK_SIZE;
+        if (!blocks_differ(x, y)) {
+            continue;
+        }
+        differing++;
+        if (b >= table && b < table_end) {
+            // An inode table block: the inodes whose slots differ changed
+            int per_block = EXT2_BLOCK_SIZE / sizeof(struct ext2_inode);
+            for (int slot = 0; slot < per_block; slot++) {
+                int inode = (b - table) * per_block + slot + 1;
+                if (inode <= inodes_count && memcmp(x + slot * sizeof(struct ext2_inode),
+                                                    y + slot * sizeof(struct ext2_inode),
+                                                    sizeof(struct ext2_inode)) != 0) {
+                    interest[inode] = 1;
+                }
+            }
+        } else if (b > 2 && b != new_image.gd->bg_block_bitmap && b != new_image.gd->bg_inode_bitmap) {
+            // A data, dir or indirect block: its owners changed
+            owned[b / 8] |= 1 << (b % 8);
+            owned_count++;
+        }
+    }
+    free(changed);
+    munmap(old_image.disk, old_image.size);
+    munmap(new_image.disk, new_image.size);
+
+    /******************************************************************
+	 * Map the changed blocks to inodes and paths
+	 ******************************************************************/
+    int candidates = owned_count;
+    for (int i = 1; i <= inodes_count && candidates == 0; i++) {
+        candidates = interest[i];
+    }
+    // Only the superblock, group descriptor or bitmaps differ, if anything
+    if (candidates > 0) {
+        stats_phase("map");
+        scan_image(&old_image, interest, owned, owned_count);
+        scan_image(&new_image, interest, owned, owned_count);
+    }
+    free(owned);
+
+    /******************************************************************
+	 * Report
+	 ******************************************************************/
+    stats_phase("report");
+    struct diff_change *changes = NULL;
+    int count = 0;
+    int added = 0;
+    int removed = 0;
+    int modified = 0;
+    for (int i = 1; i <= inodes_count && candidates > 0; i++) {
+        if (!interest[i] || (i < EXT2_GOOD_OLD_FIRST_INO && i != EXT2_ROOT_INO)) {
+            continue;
+        }
+        int was = old_image.in_use[i];
+        int is = new_image.in_use[i];
+        char *old_path = old_image.path_of[i];
+        char *new_path = new_image.path_of[i];
+        // A reused inode, or one that moved, is the old file removed and a
+        // new one added
+        if (was && is && (old_path == NULL || new_path == NULL || strcmp(old_path, new_path) == 0)) {
+            add_change(&changes, &count, 'M', i, new_path != NULL ? &new_image : &old_image);
+            modified++;
+            continue;
+        }
+        if (was) {
+            add_change(&changes, &count, 'D', i, &old_image);
+            removed++;
+        }
+        if (is) {
+            add_change(&changes, &count, 'A', i, &new_image);
+            added++;
+        }
+    }
+    qsort(changes, count, sizeof(struct diff_change), compare_change);
+    for (int k = 0; k < count; k++) {
+        struct diff_change *change = &changes[k];
+        if (change->path == NULL) {
+            printf("%c\tinode [%d] (unreachable)\n", change->kind, change->inode);
+        } else {
+            printf("%c\t%s%s\n", change->kind, change->path,
+                   change->dir && strcmp(change->path, "/") != 0 ? "/" : "");
+        }
+    }
+    printf("%d blocks differ (%d KB): %d added, %d removed, %d modified\n", differing,
+           differing * EXT2_BLOCK_SIZE / 1024, added, removed, modified);
+
+    free(changes);
+    free(interest);
+    if (candidates > 0) {
+        free_diff_image(&old_image);
+        free_diff_image(&new_image);
+    }
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return differing > 0;
+}
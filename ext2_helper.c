@@ -1,65 +1,448 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
+
+unsigned char *disk;
+struct ext2_super_block *sb;
+struct ext2_group_desc *gd;
+unsigned char *block_bitmap;
+unsigned char *inode_bitmap;
+struct ext2_inode *inode_table;
+int total_fixes;
+
+#ifndef EXT2_NO_STATS
+struct ext2_stats stats;
+#endif
+// Phase names and start times in microseconds, for --stats
+static char *tool_name;
+static char *phase_names[STATS_MAX_PHASES];
+static double phase_starts[STATS_MAX_PHASES];
+static int phase_count;
+
+// Concurrency state, used between enable_concurrency and
+// disable_concurrency. The bitmaps are split into ALLOC_SHARDS slices; a
+// thread allocates from its home slice first, so threads rarely touch
+// the same bitmap bytes. Free count changes go to a per-shard delta, on
+// its own cache line, instead of the shared sb/gd counters.
+int concurrent;
+struct alloc_shard {
+    int hint;           // byte of the slice to start the next scan at
+    long free_delta;    // free count change not yet folded into sb/gd
+    long dirs_delta;    // used dirs count change, inode shards only
+} __attribute__((aligned(64)));
+static struct alloc_shard block_shards[ALLOC_SHARDS];
+static struct alloc_shard inode_shards[ALLOC_SHARDS];
+static int next_home;
+static __thread int home_shard = -1;
+static pthread_rwlock_t dir_locks[DIR_LOCK_BUCKETS];
+// Link counts are reached through different directories, so their updates
+// need a lock of their own between threads
+static pthread_mutex_t links_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Takes of each bucket by this thread, so a nested take only counts
+static __thread struct {
+    int depth;
+    int write;
+} held_dirs[DIR_LOCK_BUCKETS];
+
+static int thread_shard(void) {
+    if (home_shard == -1) {
+        home_shard = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED) % ALLOC_SHARDS;
+    }
+    return home_shard;
+}
+
+/******************************************************************
+ * Cross-process locks, taken while the image is shared (see
+ * share_image): the sb and gd blocks for the free counts, each bitmap
+ * block, and an inode's slot in the inode table, which for a directory
+ * also stands for its blocks. Nested locks are taken inodes first, then
+ * the inode bitmap, the block bitmap and the counts.
+ ******************************************************************/
+void counts_lock(void) {
+    lock_range(EXT2_BLOCK_SIZE, 2 * EXT2_BLOCK_SIZE, 1);
+}
+
+void counts_unlock(void) {
+    unlock_range(EXT2_BLOCK_SIZE, 2 * EXT2_BLOCK_SIZE);
+}
+
+// Only the image's own bitmaps are locked; callers also pass private copies
+void bitmap_lock(unsigned char *bitmap) {
+    if (bitmap == block_bitmap || bitmap == inode_bitmap) {
+        lock_range(bitmap - disk, EXT2_BLOCK_SIZE, 1);
+    }
+}
+
+void bitmap_unlock(unsigned char *bitmap) {
+    if (bitmap == block_bitmap || bitmap == inode_bitmap) {
+        unlock_range(bitmap - disk, EXT2_BLOCK_SIZE);
+    }
+}
+
+static long long inode_offset(int inode) {
+    return (long long)gd->bg_inode_table * EXT2_BLOCK_SIZE + (inode - 1) * sizeof(struct ext2_inode);
+}
+
+void inode_lock(int inode, int write) {
+    lock_range(inode_offset(inode), sizeof(struct ext2_inode), write);
+}
+
+void inode_unlock(int inode) {
+    unlock_range(inode_offset(inode), sizeof(struct ext2_inode));
+}
+
+// links_lock is held to change the link count of inode and its checksum.
+// The inode's range lock nests inside one process, so threads running
+// concurrently also share a mutex.
+void links_lock(int inode) {
+    inode_lock(inode, 1);
+    if (concurrent) {
+        pthread_mutex_lock(&links_mutex);
+    }
+}
+
+void links_unlock(int inode) {
+    if (concurrent) {
+        pthread_mutex_unlock(&links_mutex);
+    }
+    inode_unlock(inode);
+}
+
+// add_used_dirs adds delta to the used dirs count of the group, or to the
+// calling thread's shard while running concurrently.
+void add_used_dirs(int delta) {
+    if (concurrent) {
+        __atomic_fetch_add(&inode_shards[thread_shard()].dirs_delta, delta, __ATOMIC_RELAXED);
+        return;
+    }
+    counts_lock();
+    gd->bg_used_dirs_count += delta;
+    update_group_csum();
+    counts_unlock();
+}
+
+// Add delta to the free count that matches bitmap: straight into sb and gd,
+// or into the calling thread's shard while running concurrently.
+static void adjust_free_count(unsigned char* bitmap, int delta) {
+    if (concurrent) {
+        struct alloc_shard *shards = bitmap == inode_bitmap ? inode_shards : block_shards;
+        __atomic_fetch_add(&shards[thread_shard()].free_delta, delta, __ATOMIC_RELAXED);
+    } else if (bitmap == inode_bitmap) {
+        counts_lock();
+        sb->s_free_inodes_count += delta;
+        gd->bg_free_inodes_count += delta;
+        update_group_csum();
+        counts_unlock();
+    } else if (bitmap == block_bitmap) {
+        counts_lock();
+        sb->s_free_blocks_count += delta;
+        gd->bg_free_blocks_count += delta;
+        update_group_csum();
+        counts_unlock();
+    }
+}
+
+// enable_concurrency lets several threads call the allocation and dir
+// entry helpers at once. It returns 0, leaving the helpers single-threaded,
+// when the I/O backend cannot be shared between threads.
+int enable_concurrency(void) {
+    if (!io_thread_safe()) {
+        return 0;
+    }
+    // Threads claim bits and fold counts without taking the locks, so
+    // other processes are kept out of the allocator until the end.
+    bitmap_lock(inode_bitmap);
+    bitmap_lock(block_bitmap);
+    counts_lock();
+    for (int i = 0; i < DIR_LOCK_BUCKETS; i++) {
+        pthread_rwlock_init(&dir_locks[i], NULL);
+    }
+    for (int i = 0; i < ALLOC_SHARDS; i++) {
+        block_shards[i].hint = -1;
+        block_shards[i].free_delta = 0;
+        inode_shards[i].hint = -1;
+        inode_shards[i].free_delta = 0;
+        inode_shards[i].dirs_delta = 0;
+    }
+    concurrent = 1;
+    return 1;
+}
+
+// disable_concurrency folds the shard deltas into sb and gd, and brings
+// the checksums the threads left alone up to date. Call it once every
+// worker thread has been joined.
+void disable_concurrency(void) {
+    if (!concurrent) {
+        return;
+    }
+    concurrent = 0;
+    update_bitmap_csum(block_bitmap);
+    update_bitmap_csum(inode_bitmap);
+    for (int i = 0; i < ALLOC_SHARDS; i++) {
+        adjust_free_count(block_bitmap, block_shards[i].free_delta);
+        adjust_free_count(inode_bitmap, inode_shards[i].free_delta);
+        add_used_dirs(inode_shards[i].dirs_delta);
+        block_shards[i].free_delta = 0;
+        inode_shards[i].free_delta = 0;
+        inode_shards[i].dirs_delta = 0;
+    }
+    for (int i = 0; i < DIR_LOCK_BUCKETS; i++) {
+        pthread_rwlock_destroy(&dir_locks[i]);
+    }
+    counts_unlock();
+    bitmap_unlock(block_bitmap);
+    bitmap_unlock(inode_bitmap);
+}
+
+// Take bucket for the calling thread, or only count the take if the thread
+// already holds it. A read lock cannot be turned into a write lock.
+static void dir_bucket_lock(int bucket, int write) {
+    if (held_dirs[bucket].depth > 0) {
+        if (write && !held_dirs[bucket].write) {
+            fprintf(stderr, "ERROR: directory lock %d is already held for reading\n", bucket);
+            exit(1);
+        }
+        held_dirs[bucket].depth++;
+        return;
+    }
+    if (write) {
+        pthread_rwlock_wrlock(&dir_locks[bucket]);
+    } else {
+        pthread_rwlock_rdlock(&dir_locks[bucket]);
+    }
+    held_dirs[bucket].depth = 1;
+    held_dirs[bucket].write = write;
+}
+
+// Per-directory reader/writer locks, hashed by inode number. A caller may
+// hold a directory while the helpers it calls lock it again; the nested
+// takes only count. A thread holds at most one directory at a time, so two
+// directories sharing a bucket cannot deadlock. Between threads they do
+// nothing unless running concurrently; on a shared image they also lock
+// the directory's inode against other processes. Readers then take the
+// bucket exclusively, so the inode's lock is never held for two threads
+// at once.
+void dir_read_lock(int inode) {
+    if (concurrent) {
+        dir_bucket_lock(inode % DIR_LOCK_BUCKETS, image_shared());
+    }
+    inode_lock(inode, 0);
+}
+
+void dir_write_lock(int inode) {
+    if (concurrent) {
+        dir_bucket_lock(inode % DIR_LOCK_BUCKETS, 1);
+    }
+    inode_lock(inode, 1);
+}
+
+void dir_unlock(int inode) {
+    inode_unlock(inode);
+    if (concurrent && --held_dirs[inode % DIR_LOCK_BUCKETS].depth == 0) {
+        pthread_rwlock_unlock(&dir_locks[inode % DIR_LOCK_BUCKETS]);
+    }
+}
+
+// Claim a free bit with compare-and-swap, from the calling thread's shard
+// first and then the others. A claimed byte only ever loses a race to
+// another claim, so the scan simply moves on.
+static int find_available_concurrent(unsigned char *bitmap, int size) {
+    struct alloc_shard *shards = bitmap == inode_bitmap ? inode_shards : block_shards;
+    int per_shard = (size + ALLOC_SHARDS - 1) / ALLOC_SHARDS;
+    int home = thread_shard();
+    for (int s = 0; s < ALLOC_SHARDS; s++) {
+        struct alloc_shard *shard = &shards[(home + s) % ALLOC_SHARDS];
+        int lo = (home + s) % ALLOC_SHARDS * per_shard;
+        int hi = lo + per_shard < size ? lo + per_shard : size;
+        int hint = __atomic_load_n(&shard->hint, __ATOMIC_RELAXED);
+        int start = hint >= lo && hint < hi ? hint : lo;
+        for (int k = 0; k < hi - lo; k++) {
+            int i = lo + (start - lo + k) % (hi - lo);
+            unsigned char old = __atomic_load_n(&bitmap[i], __ATOMIC_RELAXED);
+            while (old != 0xff) {
+                STAT_ADD(bitmap_bits_scanned, 8);
+                int j = __builtin_ctz(~old & 0xff);
+                if (__atomic_compare_exchange_n(&bitmap[i], &old, old | (1 << j), 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                    __atomic_store_n(&shard->hint, i, __ATOMIC_RELAXED);
+                    adjust_free_count(bitmap, -1);
+                    return i * 8 + (j + 1);
+                }
+            }
+        }
+    }
+    return -1;
+}
 
 // Function for finding the *next* available free spot in the bitmap
-// The size determine whether the function should find free spot for inode or block bitmap
+// The size is the number of bytes of the bitmap to search
 // find_next_available will also check if there are any free spaces before looking.
+// Inodes are zeroed when handed out, so neither a deleted file's block map
+// nor a lazily initialized inode table leaks into the new inode.
+// While running concurrently the free counts lag behind, so running out
+// of space shows up as a failed scan instead.
 int find_next_available(unsigned char *bitmap, int size) {
+    if (concurrent) {
+        int num = find_available_concurrent(bitmap, size);
+        if (num == -1) {
+            fprintf(stderr, "ERROR: Not enough space in the file system\n");
+            exit(ENOSPC);
+        }
+        if (bitmap == inode_bitmap) {
+            memset(&inode_table[num - 1], 0, sizeof(struct ext2_inode));
+        }
+        return num;
+    }
     if (gd->bg_free_blocks_count == 0 || gd->bg_free_inodes_count == 0) {
         fprintf(stderr, "ERROR: Not enough space in the file system\n");
         exit(ENOSPC);
     }
 
     int bit;
+    bitmap_lock(bitmap);
     for (int i = 0 ; i < size ; i++) {
         for (int j = 0; j < 8; j++) {
+            STAT_ADD(bitmap_bits_scanned, 1);
             bit = (bitmap[i] >> j) & 1;
             if ( bit == 0 ) {
                 int num = i * 8 + (j + 1);
                 set_bit(bitmap, num, size);
+                bitmap_unlock(bitmap);
+                if (bitmap == inode_bitmap) {
+                    memset(&inode_table[num - 1], 0, sizeof(struct ext2_inode));
+                }
                 return num;
             }
         }
     }
+    bitmap_unlock(bitmap);
     return -1;
 }
 
 // Set/unset the specific bit in the bitmap
-// The size determine whether the function should find free spot for inode or block bitmap
 // It also adjusts the free block counts / free inode counts accordingly.
 void set_bit(unsigned char* bitmap, int num, int size) {
     int byte = (num - 1) / 8;
     int bit = (num - 1) % 8;
 
-    bitmap[byte] |= 1 << bit;
-    if (size == 4) {
-        sb->s_free_inodes_count--;
-        gd->bg_free_inodes_count--;
-    } else if (size == 16) {
-        sb->s_free_blocks_count--;
-        gd->bg_free_blocks_count--;
+    if (concurrent) {
+        __atomic_fetch_or(&bitmap[byte], 1 << bit, __ATOMIC_ACQ_REL);
+    } else {
+        bitmap_lock(bitmap);
+        bitmap[byte] |= 1 << bit;
+        update_bitmap_csum(bitmap);
+        bitmap_unlock(bitmap);
     }
+    adjust_free_count(bitmap, -1);
 }
 
 void unset_bit(unsigned char* bitmap, int num, int size) {
     int byte = (num - 1) / 8;
     int bit = (num - 1) % 8;
 
-    bitmap[byte] &= ~( 1 << bit); // unset
-    if (size == 4) {
-        sb->s_free_inodes_count++;
-        gd->bg_free_inodes_count++;
-        return;
-    } else if (size == 16) {
-        sb->s_free_blocks_count++;
-        gd->bg_free_blocks_count++;
-        return;
+    if (concurrent) {
+        __atomic_fetch_and(&bitmap[byte], ~(1 << bit), __ATOMIC_ACQ_REL);
+    } else {
+        bitmap_lock(bitmap);
+        bitmap[byte] &= ~( 1 << bit); // unset
+        update_bitmap_csum(bitmap);
+        bitmap_unlock(bitmap);
+    }
+    adjust_free_count(bitmap, 1);
+}
+
+// Set or clear count bits from num on: single bits up to a byte boundary,
+// whole bytes up to a word boundary, then 64 bits at a time. Running
+// concurrently, each byte is updated with one atomic and-or instead.
+// It returns how many bits actually changed.
+static int change_bit_range(unsigned char* bitmap, int num, int count, int set) {
+    int bit = num - 1;
+    int end = bit + count;
+    int changed = 0;
+    while (bit < end && concurrent) {
+        int last = (bit / 8 + 1) * 8 < end ? (bit / 8 + 1) * 8 : end;
+        unsigned char mask = 0xff << (bit % 8);
+        if (last % 8 != 0) {
+            mask &= 0xff >> (8 - last % 8);
+        }
+        unsigned char old = set ? __atomic_fetch_or(&bitmap[bit / 8], mask, __ATOMIC_ACQ_REL)
+                                : __atomic_fetch_and(&bitmap[bit / 8], ~mask, __ATOMIC_ACQ_REL);
+        changed += __builtin_popcount(set ? mask & ~old : mask & old);
+        bit = last;
+    }
+    while (bit < end) {
+        if (bit % 64 == 0 && end - bit >= 64) {
+            unsigned long long word;
+            memcpy(&word, bitmap + bit / 8, sizeof(word));
+            changed += set ? 64 - __builtin_popcountll(word) : __builtin_popcountll(word);
+            word = set ? ~0ULL : 0;
+            memcpy(bitmap + bit / 8, &word, sizeof(word));
+            bit += 64;
+        } else if (bit % 8 == 0 && end - bit >= 8) {
+            changed += set ? 8 - __builtin_popcount(bitmap[bit / 8]) : __builtin_popcount(bitmap[bit / 8]);
+            bitmap[bit / 8] = set ? 0xff : 0;
+            bit += 8;
+        } else {
+            int mask = 1 << (bit % 8);
+            if (((bitmap[bit / 8] & mask) != 0) != set) {
+                bitmap[bit / 8] ^= mask;
+                changed++;
+            }
+            bit++;
+        }
+    }
+    return changed;
+}
+
+// Set/unset count bits starting at num, adjusting the free counts once for
+// the whole range by the number of bits that changed.
+void set_bit_range(unsigned char* bitmap, int num, int count, int size) {
+    bitmap_lock(bitmap);
+    int changed = change_bit_range(bitmap, num, count, 1);
+    update_bitmap_csum(bitmap);
+    bitmap_unlock(bitmap);
+    adjust_free_count(bitmap, -changed);
+}
+
+void unset_bit_range(unsigned char* bitmap, int num, int count, int size) {
+    bitmap_lock(bitmap);
+    int changed = change_bit_range(bitmap, num, count, 0);
+    update_bitmap_csum(bitmap);
+    bitmap_unlock(bitmap);
+    adjust_free_count(bitmap, changed);
+}
+
+// Set/unset every block of list in the block bitmap. Runs of consecutive
+// block numbers are coalesced into one range update each.
+void set_block_list(int* list, int n) {
+    for (int i = 0; i < n; ) {
+        int run = 1;
+        while (i + run < n && list[i + run] == list[i] + run) {
+            run++;
+        }
+        set_bit_range(block_bitmap, list[i], run, BLOCK_BITMAP_SIZE);
+        i += run;
+    }
+}
+
+void unset_block_list(int* list, int n) {
+    for (int i = 0; i < n; ) {
+        int run = 1;
+        while (i + run < n && list[i + run] == list[i] + run) {
+            run++;
+        }
+        unset_bit_range(block_bitmap, list[i], run, BLOCK_BITMAP_SIZE);
+        i += run;
     }
 }
 
@@ -84,7 +467,7 @@ int actual_rec_len(int name_len) {
 // Given a name, check_exist will check whether a dir entry with the
 // same name exists in the inode dir entry
 // On success, check_exist will return the existing inode, and 0 otherwise.
-int check_exist(char* name, int inode) {
+static int check_exist_unlocked(char* name, int inode) {
     int block_num;
     int indirect_block_num;
     unsigned char* indirect_block;
@@ -94,29 +477,37 @@ int check_exist(char* name, int inode) {
     int data_blocks = inode_table[inode - 1].i_blocks / 2;
     if ( inode_table[inode - 1].i_blocks / 2 > 12 ) {
         indirect_block_num = inode_table[inode - 1].i_block[12];
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
         data_blocks--;
     }
 
     for (int i = 0; i < data_blocks ; i++) {
+        STAT_ADD(dir_blocks_walked, 1);
         if (i < 12) {
             block_num = inode_table[inode - 1].i_block[i];
         } else {
             indirect_idx = i - 12;
+            indirect_block = get_block(indirect_block_num);
             memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
+            STAT_ADD(indirect_lookups, 1);
         }
 
         int len = strlen(name);
-        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)get_block(block_num);
+        STAT_ADD(dir_entries_compared, 1);
         if (len == entry->name_len && (strncmp(name, entry->name, len) == 0)) {
             return entry->inode;
         }
         struct ext2_dir_entry *next; 
         int rec_len = entry->rec_len;
     
-        while (rec_len != EXT2_BLOCK_SIZE) {
+        while (rec_len < EXT2_BLOCK_SIZE) {
 
             next = (struct ext2_dir_entry *)((char *)entry + rec_len);
+            // Only a reader racing a writer sees this (see read_retry)
+            if (next->rec_len == 0) {
+                break;
+            }
+            STAT_ADD(dir_entries_compared, 1);
             if (len == next->name_len && (strncmp(name, next->name, len) == 0)) {
                 return next->inode;
             }
@@ -126,6 +517,14 @@ int check_exist(char* name, int inode) {
     return 0;
 }
 
+// check_exist holds the directory's read lock for the lookup.
+int check_exist(char* name, int inode) {
+    dir_read_lock(inode);
+    int found = check_exist_unlocked(name, inode);
+    dir_unlock(inode);
+    return found;
+}
+
 // inode_num returns the inode number of the last entry in the path if exists,
 // Otherwise, it should return 0.
 int inode_num(char* path, int* prev) {
@@ -201,7 +600,7 @@ void validate_path(char* path, int flag) {
 
 // Insert new_inode after the parent_inode's last existing dir entry
 // with the given name. It also sets the type for the new dir entry.
-void insert_dir_entry(int new_inode, char* name, int parent_inode, int type) {
+static void insert_dir_entry_unlocked(int new_inode, char* name, int parent_inode, int type) {
     if (new_inode == 0) {
         fprintf(stderr, "ERROR: insert_dir_entry: inode is not a not valid\n");
         exit(1);
@@ -216,15 +615,17 @@ void insert_dir_entry(int new_inode, char* name, int parent_inode, int type) {
     int data_blocks = inode_table[parent_inode - 1].i_blocks / 2;
     if ( data_blocks > 12 ) {
         indirect_block_num = inode_table[parent_inode - 1].i_block[12];
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
         indirect_idx = data_blocks - 13;
+        indirect_block = get_block(indirect_block_num);
         memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
+        STAT_ADD(indirect_lookups, 1);
         data_blocks--;
     } else {
         block_num = inode_table[parent_inode - 1].i_block[data_blocks  - 1];
     }
 
-    struct ext2_dir_entry *base_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
+    struct ext2_dir_entry *base_entry = (struct ext2_dir_entry *)get_block(block_num);
+    STAT_ADD(dir_blocks_walked, 1);
     struct ext2_dir_entry *next; 
     struct ext2_dir_entry *new_entry;
     int len = strlen(name);
@@ -239,45 +640,74 @@ void insert_dir_entry(int new_inode, char* name, int parent_inode, int type) {
     }
 
     // Search it recusively
-    while (rec_len != EXT2_BLOCK_SIZE) {
+    while (rec_len != DIR_BLOCK_END) {
         next = (struct ext2_dir_entry *)((char *)base_entry + rec_len);
         
         // Last dir_entry
-        if (rec_len + next->rec_len == EXT2_BLOCK_SIZE) {
+        if (rec_len + next->rec_len == DIR_BLOCK_END) {
             int actual_size = actual_rec_len(next->name_len);
             int offset = rec_len + actual_size;
             
             // Check if there is enoguh space for the new dir entry
             // Create the dir entry in a new block if not.
             int new_rec_len = actual_rec_len(len);
-            int avail_space = EXT2_BLOCK_SIZE - offset;
-            if (new_rec_len <= avail_space) {
+            int avail_space = DIR_BLOCK_END - offset;
+            if (next->inode == 0 && new_rec_len <= next->rec_len) {
+                // An empty entry (like the spare lost+found blocks hold) is
+                // reused rather than shrunk to a record fsck rejects.
+                new_entry = next;
+            } else if (new_rec_len <= avail_space) {
                 new_entry = (struct ext2_dir_entry *)((char *)base_entry + offset);
                 new_entry->rec_len = avail_space;
                 next->rec_len = actual_size;
             } else {
                 block_num = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
-                new_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num); 
-                new_entry->rec_len = EXT2_BLOCK_SIZE;
+                new_entry = (struct ext2_dir_entry *)get_new_block(block_num);
+                new_entry->rec_len = DIR_BLOCK_END;
+                init_dir_tail((unsigned char *)new_entry);
                 inode_table[parent_inode-1].i_blocks += 2;
                 int num_blocks = inode_table[parent_inode-1].i_blocks;
                 inode_table[parent_inode-1].i_block[num_blocks / 2 - 1] = block_num;
                 inode_table[parent_inode-1].i_size += EXT2_BLOCK_SIZE;
+                update_inode_csum(parent_inode);
             }
             new_entry->inode = new_inode;
             new_entry->name_len = len;
             new_entry->file_type = 0;
             new_entry->file_type |= type;
             memcpy(new_entry->name, name, len);
+            update_dir_csum(parent_inode, block_num);
             return;
         }
         rec_len += next->rec_len;
     }
 }
 
+// insert_dir_entry holds the parent's write lock, which also covers the
+// parent inode's block map when the directory grows.
+void insert_dir_entry(int new_inode, char* name, int parent_inode, int type) {
+    dir_write_lock(parent_inode);
+    insert_dir_entry_unlocked(new_inode, name, parent_inode, type);
+    dir_unlock(parent_inode);
+}
+
+// Drop one link of inode. If this is the last link, remove the inode
+// from the filesystem altogether.
+static void drop_link(int inode) {
+    inode_lock(inode, 1);
+    links_lock(inode);
+    int links = --inode_table[inode - 1].i_links_count;
+    update_inode_csum(inode);
+    links_unlock(inode);
+    if (links == 0) {
+        cleanup_inode(inode);
+    }
+    inode_unlock(inode);
+}
+
 // Remove a file/link dir entry in the parent_inode dir entry.
 // It will search for the entry with the same name and inode number.
-void remove_dir_entry(int inode, char* name,int parent_inode) {
+static void remove_dir_entry_unlocked(int inode, char* name,int parent_inode) {
     if (inode == 0) {
         fprintf(stderr, "ERROR: remove_dir_entry: inode is not a not valid\n");
         exit(1);
@@ -292,28 +722,26 @@ void remove_dir_entry(int inode, char* name,int parent_inode) {
     int data_blocks = inode_table[parent_inode - 1].i_blocks / 2;
     if ( inode_table[parent_inode - 1].i_blocks / 2 > 12 ) {
         indirect_block_num = inode_table[parent_inode - 1].i_block[12];
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
         data_blocks--;
     }
 
     for (int i = 0; i < data_blocks ; i++) {
+        STAT_ADD(dir_blocks_walked, 1);
         if (i < 12) {
             block_num = inode_table[parent_inode - 1].i_block[i];
         } else {
             indirect_idx = i - 12;
+            indirect_block = get_block(indirect_block_num);
             memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
+            STAT_ADD(indirect_lookups, 1);
         }
 
-        struct ext2_dir_entry *base_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
+        struct ext2_dir_entry *base_entry = (struct ext2_dir_entry *)get_block(block_num);
         if (base_entry->inode == inode && \
          (strncmp(name, base_entry->name, len) == 0)) {   // next is the target dir entry, remove it
             base_entry->inode = 0;
-            inode_table[inode - 1].i_links_count--;
-            if (inode_table[inode - 1].i_links_count == 0) {   
-                // If this is the last link
-                // Remove the inode from the filesystem altogether
-                cleanup_inode(inode);
-            }
+            update_dir_csum(parent_inode, block_num);
+            drop_link(inode);
             return;
         }
 
@@ -321,19 +749,15 @@ void remove_dir_entry(int inode, char* name,int parent_inode) {
         struct ext2_dir_entry *next; 
         int rec_len = 0;
 
-        while (rec_len != EXT2_BLOCK_SIZE) {
+        while (rec_len != DIR_BLOCK_END) {
             curr = (struct ext2_dir_entry *)((char *)base_entry + rec_len);
             next = (struct ext2_dir_entry *)((char *)base_entry + rec_len + curr->rec_len);
             if (next->inode == inode && \
                 (strncmp(name, next->name, len) == 0)) {   
                 // next is the target dir entry, remove it
                 curr->rec_len += next->rec_len;
-                inode_table[inode - 1].i_links_count--;
-                if (inode_table[inode - 1].i_links_count == 0) {   
-                    // If this is the last link
-                    // Remove the inode from the filesystem altogether
-                    cleanup_inode(inode);
-                }
+                update_dir_csum(parent_inode, block_num);
+                drop_link(inode);
                 return;
             }
             rec_len += curr->rec_len;
@@ -341,6 +765,12 @@ void remove_dir_entry(int inode, char* name,int parent_inode) {
     }
 }
 
+void remove_dir_entry(int inode, char* name,int parent_inode) {
+    dir_write_lock(parent_inode);
+    remove_dir_entry_unlocked(inode, name, parent_inode);
+    dir_unlock(parent_inode);
+}
+
 // cleanup_inode removes inode from the filesystem.
 // It releases all the data blocks that it has claimed and also the
 // inode number
@@ -350,114 +780,136 @@ void cleanup_inode(int inode) {
         fprintf(stderr, "ERROR: cleanup: inode is not a not valid\n");
         exit(ENOENT);
     }
-    int indirect_block_num;
-    unsigned char* indirect_block;
-    int indirect_idx;
-    int block_num;
-    int data_blocks = inode_table[inode - 1].i_blocks / 2;
-    if ( inode_table[inode - 1].i_blocks / 2 > 12 ) {
-        indirect_block_num = inode_table[inode - 1].i_block[12];
-        unset_bit(block_bitmap, indirect_block_num, BLOCK_BITMAP_SIZE);
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
-        data_blocks--;
-    }
-    for (int i = 0; i < data_blocks; i++) {
-        if (i < 12) {
-            unset_bit(block_bitmap, inode_table[inode - 1].i_block[i], BLOCK_BITMAP_SIZE);
-        } else {
-            indirect_idx = i - 12;
-            memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
-            unset_bit(block_bitmap, block_num, BLOCK_BITMAP_SIZE);
-        }
+    // A block map that cannot be walked keeps its blocks; the checker
+    // reclaims them once nothing claims them
+    int list[INODE_LIST_MAX];
+    int n = inode_block_list(inode, list);
+    if (n > 0) {
+        unset_block_list(list, n);
     }
     unset_bit(inode_bitmap, inode, INODE_BITMAP_SIZE);
     inode_table[inode - 1].i_dtime = time(NULL);
+    update_inode_csum(inode);
+}
+
+// release_inodes frees every block and inode of the given inodes, like
+// cleanup_inode does for one. Blocks go back a run at a time, and the
+// inodes are cleared and counted in one pass.
+void release_inodes(int *inodes, int n) {
+    int list[INODE_LIST_MAX];
+    unsigned int now = time(NULL);
+    int freed_inodes = 0;
+    for (int i = 0; i < n; i++) {
+        int inode = inodes[i];
+        int blocks = inode_block_list(inode, list);
+        if (blocks > 0) {
+            unset_block_list(list, blocks);
+        }
+        freed_inodes += change_bit_range(inode_bitmap, inode, 1, 0);
+        inode_table[inode - 1].i_dtime = now;
+        update_inode_csum(inode);
+    }
+    bitmap_lock(inode_bitmap);
+    update_bitmap_csum(inode_bitmap);
+    bitmap_unlock(inode_bitmap);
+    adjust_free_count(inode_bitmap, freed_inodes);
 }
 
 // For BONUS:
 // Similar to remove_dir_entry, but this removes directory as well.
-// remove_dir recursively removes all the file including directories in the dir_entry
-// If the direcotry contains any file/link, it will call remove_dir_entry to remove it.
-// and remove_dir for any subdirectories.
-// Finally, removing the itself from the parent_inode dir entry
+// remove_dir tears down the tree under dir_inode with an explicit stack of
+// directories, so deep trees cannot overflow the C stack. Each directory
+// is walked once: every entry but "." and ".." is hidden in the rec_len gap
+// of the entry before it, exactly as remove_dir_entry would leave it, so
+// restore_dir can bring the tree back. Inodes whose last link goes are
+// collected and freed together by release_inodes.
 void remove_dir(int dir_inode, char* name, int parent_inode) {
     if (dir_inode == 0) {
         fprintf(stderr, "ERROR: remove_dir: inode is not a not valid\n");
         exit(ENOENT);
     }
-    char buf[EXT2_NAME_LEN];
-    int indirect_block_num;
-    unsigned char* indirect_block;
-    int indirect_idx;
-    int block_num;
-    struct ext2_dir_entry *base_entry;
-    int data_blocks = inode_table[dir_inode - 1].i_blocks / 2;
-    if ( inode_table[dir_inode - 1].i_blocks / 2 > 12 ) {
-        indirect_block_num = inode_table[dir_inode - 1].i_block[12];
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
-        data_blocks--;
+    // Every directory is pushed once, and every inode released once
+    int *stack = malloc(sb->s_inodes_count * sizeof(int));
+    int *release = malloc(sb->s_inodes_count * sizeof(int));
+    if (stack == NULL || release == NULL) {
+        perror("malloc");
+        exit(1);
     }
-    for (int i = 0; i < data_blocks; i++) {
-        if (i < 12) {
-            block_num = inode_table[dir_inode - 1].i_block[i];
-        } else {
-            indirect_idx = i - 12;
-            memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
-        }
-
-        base_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
-
-        // Set inode num to 0 for the first inode
-        // Decrement the link count for this inode as well
-        // the link count will not be zero since the dir_inode still exists
-        if (base_entry->inode != 0 && (strncmp(base_entry->name, ".", 1) == 0)) {
-            inode_table[base_entry->inode - 1].i_links_count--;
-            base_entry->inode = 0;
-        } else if (base_entry->inode != 0 && !IS_S_DIR(base_entry->inode)) {
-            // case for the first file/link after the first data block
-            strncpy(buf, base_entry->name, base_entry->name_len);
-            buf[base_entry->name_len] = '\0';
-            remove_dir_entry(base_entry->inode, buf, dir_inode);
-            base_entry->inode = 0;
-        } else if (base_entry->inode != 0 && IS_S_DIR(base_entry->inode)) {
-            // case for the first directory after the first data block
-            strncpy(buf, base_entry->name, base_entry->name_len);
-            buf[base_entry->name_len] = '\0';
-            remove_dir(base_entry->inode, buf, dir_inode);
-        }
-
-        struct ext2_dir_entry *next; 
-        int rec_len = base_entry->rec_len;
+    int depth = 0;
+    int released = 0;
+    int dirs_removed = 1;       // dir_inode itself
+    int list[INODE_LIST_MAX];
+    stack[depth++] = dir_inode;
 
-        while (rec_len != EXT2_BLOCK_SIZE) {
-            next = (struct ext2_dir_entry *)((char *)base_entry + rec_len);
-            // If this is the hard link to the parent directory,
-            // Just decrement its link count and leave it.
-            if (next->inode != 0 && (strncmp(next->name, "..", 2) == 0 )) {
-                inode_table[next->inode - 1].i_links_count--;
-            } else if (next->inode != 0 && !IS_S_DIR(next->inode)) {
-                strncpy(buf, next->name, next->name_len);
-                buf[base_entry->name_len] = '\0';
-                remove_dir_entry(next->inode, buf, dir_inode);
-            } else if (next->inode != 0 && IS_S_DIR(next->inode)) {
-                strncpy(buf, next->name, next->name_len);
-                buf[base_entry->name_len] = '\0';
-                remove_dir(next->inode, buf,dir_inode);
+    while (depth > 0) {
+        int dir = stack[--depth];
+        dir_write_lock(dir);
+        int n = inode_block_list(dir, list);
+        prefetch_blocks(list, n);
+        for (int i = 0; i < n; i++) {
+            // The indirect block holds block numbers, not entries
+            if (i == 12 && n > 12) {
+                continue;
             }
-            rec_len += next->rec_len;
+            STAT_ADD(dir_blocks_walked, 1);
+            unsigned char *block = get_block(list[i]);
+            struct ext2_dir_entry *prev = NULL;
+            int rec_len = 0;
+            while (rec_len < DIR_BLOCK_END) {
+                struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + rec_len);
+                if (entry->rec_len == 0) {
+                    break;
+                }
+                rec_len += entry->rec_len;
+                int child = entry->inode;
+                if (child == 0) {
+                    prev = entry;
+                    continue;
+                }
+                // "." and ".." only drop the link they hold. ".." stays in
+                // place, "." is cleared like any first entry of a block.
+                int self = entry->name_len == 1 && strncmp(entry->name, ".", 1) == 0;
+                int parent = entry->name_len == 2 && strncmp(entry->name, "..", 2) == 0;
+                links_lock(child);
+                if (inode_table[child - 1].i_links_count > 0 && --inode_table[child - 1].i_links_count == 0) {
+                    release[released++] = child;
+                }
+                update_inode_csum(child);
+                links_unlock(child);
+                if (parent) {
+                    prev = entry;
+                    continue;
+                }
+                if (!self && IS_S_DIR(child) && depth < sb->s_inodes_count) {
+                    stack[depth++] = child;
+                    dirs_removed++;
+                }
+                if (prev == NULL) {
+                    entry->inode = 0;
+                    prev = entry;
+                } else {
+                    prev->rec_len += entry->rec_len;
+                }
+            }
+            update_dir_csum(dir, list[i]);
         }
+        dir_unlock(dir);
     }
+    release_inodes(release, released);
+    free(stack);
+    free(release);
 
     // Finally remove itself from the parent_inode dir entry
     // Also decrement the used dir count in the filesystem.
     remove_dir_entry(dir_inode, name,parent_inode);
-    gd->bg_used_dirs_count--;
+    add_used_dirs(-dirs_removed);
 }
 
 // check_restore checks whether a deleted file is recoverable in the dir entry
 // If the file's orginally inode num has already been reallocated. It will return 0.
 // If a deleted file's inode num is still unclaimed. It will return that specific inode num.
-int check_restore(char* name, int parent_inode) {
+// With unhide set the entry is also put back in the directory.
+static int check_restore_unlocked(char* name, int parent_inode, int unhide) {
     int block_num;
     int indirect_block_num;
     unsigned char* indirect_block;
@@ -465,25 +917,27 @@ int check_restore(char* name, int parent_inode) {
     int data_blocks = inode_table[parent_inode - 1].i_blocks / 2;
     if ( inode_table[parent_inode - 1].i_blocks / 2 > 12 ) {
         indirect_block_num = inode_table[parent_inode - 1].i_block[12];
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
         data_blocks--;
     }
 
     for (int i = 0; i < data_blocks ; i++) {
+        STAT_ADD(dir_blocks_walked, 1);
         if (i < 12) {
             block_num = inode_table[parent_inode - 1].i_block[i];
         } else {
             indirect_idx = i - 12;
+            indirect_block = get_block(indirect_block_num);
             memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
+            STAT_ADD(indirect_lookups, 1);
         }
 
-        struct ext2_dir_entry *base_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
+        struct ext2_dir_entry *base_entry = (struct ext2_dir_entry *)get_block(block_num);
         struct ext2_dir_entry *next;
         struct ext2_dir_entry *target;
         int rec_len = base_entry->rec_len;
         int name_len = strlen(name);
         int gap_len;
-        while (rec_len != EXT2_BLOCK_SIZE) {
+        while (rec_len != DIR_BLOCK_END) {
             next = (struct ext2_dir_entry *)((char *)base_entry + rec_len);
             int actual_size = actual_rec_len(next->name_len);
             // Gap exists
@@ -496,13 +950,16 @@ int check_restore(char* name, int parent_inode) {
                     if (target->name_len == 0) {
                         return 0;
                     } else if (strncmp(name, target->name, name_len) == 0) {  // name matches
-                        if (is_set(inode_bitmap, target->inode)) {   // But inode num is reallocated
+                        if (!unhide && is_set(inode_bitmap, target->inode)) {   // But inode num is reallocated
                             fprintf(stderr, "ERROR: cannot restore file %s\n", name);
                             exit(ENOENT);
+                        } else if (!unhide) {
+                            return target->inode;
                         }
                         // Adjust the rec lens
                         target->rec_len = next->rec_len - gap_len;
                         next->rec_len = gap_len;
+                        update_dir_csum(parent_inode, block_num);
                         return target->inode;
                     }
                     gap_len += actual_rec_len(target->name_len);
@@ -515,6 +972,22 @@ int check_restore(char* name, int parent_inode) {
     return 0;
 }
 
+int check_restore(char* name, int parent_inode) {
+    dir_write_lock(parent_inode);
+    int inode = check_restore_unlocked(name, parent_inode, 0);
+    dir_unlock(parent_inode);
+    return inode;
+}
+
+// unhide_restored puts the entry check_restore found back in the directory.
+// It is called once restore_dir_entry has taken the inode back, so a
+// refused restore leaves no name pointing at a free inode.
+void unhide_restored(char* name, int parent_inode) {
+    dir_write_lock(parent_inode);
+    check_restore_unlocked(name, parent_inode, 1);
+    dir_unlock(parent_inode);
+}
+
 // restore_dir_entry restores the inode num returned by check_restore
 // It will also check if any of its data blocks has been reallocated to
 // a different file as well
@@ -525,42 +998,49 @@ void restore_dir_entry(int inode, char* name, int parent_inode) {
         exit(1);
     }
 
-    set_bit(inode_bitmap, inode, 4);
-    inode_table[inode - 1].i_links_count++;
-
-    int indirect_block_num;
-    unsigned char* indirect_block;
-    int indirect_idx;
-    int block_num;
-    int data_blocks = inode_table[inode - 1].i_blocks / 2;
-    if ( inode_table[inode - 1].i_blocks / 2 > 12 ) {
-        indirect_block_num = inode_table[inode - 1].i_block[12];
-        if (is_set(block_bitmap, indirect_block_num)) {
+    // Check every block before touching anything, so a refused restore
+    // leaves the image as it was. The bitmaps stay locked until the
+    // blocks are taken back, so no other process can claim them between.
+    inode_lock(inode, 1);
+    bitmap_lock(inode_bitmap);
+    bitmap_lock(block_bitmap);
+    int list[INODE_LIST_MAX];
+    int n = inode_block_list(inode, list);
+    if (n < 0) {
+        fprintf(stderr, "ERROR: cannot restore file %s\n", name);
+        exit(ENOENT);
+    }
+    STAT_ADD(dir_blocks_walked, n);
+    for (int i = 0; i < n; i++) {
+        if (list[i] <= 0 || list[i] >= sb->s_blocks_count) {
             fprintf(stderr, "ERROR: cannot restore file %s\n", name);
             exit(ENOENT);
         }
-        set_bit(block_bitmap, indirect_block_num, 16);
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
-        data_blocks--;
-    }
-    for (int i = 0; i < data_blocks; i++) {
-        if (i < 12) {
-            if (is_set(block_bitmap, inode_table[inode - 1].i_block[i])) {
-                fprintf(stderr, "ERROR: cannot restore file %s\n", name);
-                exit(ENOENT);
-            }
-            set_bit(block_bitmap, inode_table[inode - 1].i_block[i], 16);
-        } else {
-            indirect_idx = i - 12;
-            memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
-            if (is_set(block_bitmap, block_num)) {
+        if (is_set(block_bitmap, list[i])) {
+            // Name the file that reused the block
+            struct owner_map *map = build_owner_map();
+            int owner = map->owner[list[i]];
+            free_owner_map(map);
+            if (owner > 0) {
+                fprintf(stderr, "ERROR: cannot restore file %s: block %d belongs to inode %d\n",
+                        name, list[i], owner);
+            } else {
                 fprintf(stderr, "ERROR: cannot restore file %s\n", name);
-                exit(ENOENT);
             }
-            set_bit(block_bitmap, block_num, 16);
+            exit(ENOENT);
         }
     }
+
+    set_bit(inode_bitmap, inode, INODE_BITMAP_SIZE);
+    set_block_list(list, n);
+    links_lock(inode);
+    inode_table[inode - 1].i_links_count++;
     inode_table[inode - 1].i_dtime = 0;
+    update_inode_csum(inode);
+    links_unlock(inode);
+    bitmap_unlock(block_bitmap);
+    bitmap_unlock(inode_bitmap);
+    inode_unlock(inode);
 
 }
 
@@ -583,45 +1063,58 @@ void restore_dir(int dir_inode, char* name, int parent_inode) {
     int data_blocks = inode_table[dir_inode - 1].i_blocks / 2;
     if ( inode_table[dir_inode - 1].i_blocks / 2 > 12 ) {
         indirect_block_num = inode_table[dir_inode - 1].i_block[12];
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
         data_blocks--;
     }
 
+    if (prefetch_inode(dir_inode) < 0) {
+        fprintf(stderr, "ERROR: restore_dir: directory [%d] is corrupt\n", dir_inode);
+        exit(EIO);
+    }
+
     // Restore all file in the data blocks
     for (int i = 0; i < data_blocks; i++) {
+        STAT_ADD(dir_blocks_walked, 1);
         if (i < 12) {
             block_num = inode_table[dir_inode - 1].i_block[i];
         } else {
             indirect_idx = i - 12;
+            indirect_block = get_block(indirect_block_num);
             memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
+            STAT_ADD(indirect_lookups, 1);
         }
 
         // First entry in the first data block
         // Reset the inode num to dir_inode.
         // Readjust the rec len
-        base_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
+        base_entry = (struct ext2_dir_entry *)get_block(block_num);
         if (base_entry->inode == 0 && (strncmp(base_entry->name, ".", 1) == 0)) {
             inode_table[dir_inode - 1].i_links_count = 1;
+            update_inode_csum(dir_inode);
             base_entry->inode = dir_inode;
             base_entry->rec_len = actual_rec_len(base_entry->name_len);
+            update_dir_csum(dir_inode, block_num);
         }
 
         struct ext2_dir_entry *next; 
         int rec_len = base_entry->rec_len;
 
-        while (rec_len != EXT2_BLOCK_SIZE) {
+        while (rec_len != DIR_BLOCK_END) {
             next = (struct ext2_dir_entry *)((char *)base_entry + rec_len);
             int actual_size = actual_rec_len(next->name_len);
             struct ext2_dir_entry *end = (struct ext2_dir_entry *)((char *)next + actual_size);
             // Check if next is the last dir entry in the data block
             if (end->name_len != 0) {
                 next->rec_len = actual_rec_len(next->name_len);
+                update_dir_csum(dir_inode, block_num);
             }
 
             // For any file/link, restore_dir call restore_dir_entry to restore them.
             // For any subdirecotry, call restore_dir instead.
             if (next->inode != 0 && (strncmp(next->name, "..", 2) == 0 )) {
-                inode_table[next->inode - 1].i_links_count++;         
+                links_lock(next->inode);
+                inode_table[next->inode - 1].i_links_count++;
+                update_inode_csum(next->inode);
+                links_unlock(next->inode);
             } else if (next->inode != 0 && !IS_S_DIR(next->inode)) {
                 strncpy(buf, next->name, next->name_len);
                 buf[base_entry->name_len] = '\0';
@@ -630,6 +1123,9 @@ void restore_dir(int dir_inode, char* name, int parent_inode) {
                 strncpy(buf, next->name, next->name_len);
                 buf[base_entry->name_len] = '\0';
                 restore_dir(next->inode, buf,dir_inode);
+                // The subdirectory may have pushed this block out of the block cache
+                base_entry = (struct ext2_dir_entry *)get_block(block_num);
+                next = (struct ext2_dir_entry *)((char *)base_entry + rec_len);
             }
             rec_len += next->rec_len;
         }
@@ -638,7 +1134,7 @@ void restore_dir(int dir_inode, char* name, int parent_inode) {
     // Finally, restore itself in the parent_inode dir entry
     // Increment the used dir count for the filesystem.
     restore_dir_entry(dir_inode, name,parent_inode);
-    gd->bg_used_dirs_count++;
+    add_used_dirs(1);
 
 }
 
@@ -655,61 +1151,1431 @@ void examine_dir_inode(int dir_inode) {
     int data_blocks = inode_table[dir_inode - 1].i_blocks / 2;
     if ( inode_table[dir_inode - 1].i_blocks / 2 > 12 ) {
         indirect_block_num = inode_table[dir_inode - 1].i_block[12];
-        indirect_block = disk + EXT2_BLOCK_SIZE * indirect_block_num;
         data_blocks--;
     }
+    if (prefetch_inode(dir_inode) < 0) {
+        fprintf(stderr, "Found: directory [%d] has a corrupt block map, not examined\n", dir_inode);
+        return;
+    }
     for (int i = 0; i < data_blocks; i++) {
+        STAT_ADD(dir_blocks_walked, 1);
         if (i < 12) {
             block_num = inode_table[dir_inode - 1].i_block[i];
         } else {
             indirect_idx = i - 12;
+            indirect_block = get_block(indirect_block_num);
             memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
+            STAT_ADD(indirect_lookups, 1);
         }
 
-        base_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
+        base_entry = (struct ext2_dir_entry *)get_block(block_num);
         if (IS_S_DIR(base_entry->inode) && !IS_FT_DIR(base_entry->file_type))  {
             fprintf(stderr, "Fixed: Entry type vs inode mismatch: inode [%d]\n",
             base_entry->inode);
             base_entry->file_type = 0;
             base_entry->file_type |= EXT2_FT_DIR;
             total_fixes++;
+            update_dir_csum(dir_inode, block_num);
         } else if (IS_S_FILE(base_entry->inode) && !IS_FT_FILE(base_entry->file_type))  {
             fprintf(stderr, "Fixed: Entry type vs inode mismatch: inode [%d]\n",
             base_entry->inode);
             base_entry->file_type = 0;
             base_entry->file_type |= EXT2_FT_REG_FILE;
             total_fixes++;
+            update_dir_csum(dir_inode, block_num);
         } else if (IS_S_LINK(base_entry->inode) && !IS_FT_LINK(base_entry->file_type))  {
             fprintf(stderr, "Fixed: Entry type vs inode mismatch: inode [%d]\n",
             base_entry->inode);
             base_entry->file_type = 0;
             base_entry->file_type |= EXT2_FT_SYMLINK;
             total_fixes++;
+            update_dir_csum(dir_inode, block_num);
         }
 
         struct ext2_dir_entry *next; 
         int rec_len = base_entry->rec_len;
 
-        while (rec_len != EXT2_BLOCK_SIZE) {
+        while (rec_len != DIR_BLOCK_END) {
             next = (struct ext2_dir_entry *)((char *)base_entry + rec_len);
             if (IS_S_DIR(next->inode) && !IS_FT_DIR(next->file_type))  {
                 fprintf(stderr, "Fixed: Entry type vs inode mismatch: inode [%d]\n", next->inode);
                 next->file_type = 0;
                 next->file_type |= EXT2_FT_DIR;
                 total_fixes++;
+                update_dir_csum(dir_inode, block_num);
             } else if (IS_S_FILE(next->inode) && !IS_FT_FILE(next->file_type))  {
                 fprintf(stderr, "Fixed: Entry type vs inode mismatch: inode [%d]\n",next->inode);
                 next->file_type = 0;
                 next->file_type |= EXT2_FT_REG_FILE;
                 total_fixes++;
+                update_dir_csum(dir_inode, block_num);
             } else if (IS_S_LINK(next->inode) && !IS_FT_LINK(next->file_type))  {
                 fprintf(stderr, "Fixed: Entry type vs inode mismatch: inode [%d]\n",
                 next->inode);
                 next->file_type = 0;
                 next->file_type |= EXT2_FT_SYMLINK;
                 total_fixes++;
+                update_dir_csum(dir_inode, block_num);
             }
             rec_len += next->rec_len;
         }
     }
 }
+
+// compact_dir rewrites the live dir entries of dir_inode densely into the
+// fewest data blocks, dropping deleted entries and rec_len slack.
+// Trailing blocks that are no longer needed (and the indirect block if the
+// directory shrinks back to 12 blocks or less) are released, and i_size
+// and i_blocks are updated accordingly.
+// It returns the number of blocks released.
+int compact_dir(int dir_inode) {
+    if (dir_inode == 0) {
+        fprintf(stderr, "ERROR: compact_dir: inode is not a not valid\n");
+        exit(ENOENT);
+    }
+    int indirect_block_num = 0;
+    unsigned char* indirect_block;
+    int indirect_idx;
+    int block_num;
+    int data_blocks = inode_table[dir_inode - 1].i_blocks / 2;
+    if ( inode_table[dir_inode - 1].i_blocks / 2 > 12 ) {
+        indirect_block_num = inode_table[dir_inode - 1].i_block[12];
+        data_blocks--;
+    }
+    if (prefetch_inode(dir_inode) < 0) {
+        fprintf(stderr, "ERROR: compact_dir: directory [%d] is corrupt\n", dir_inode);
+        exit(EIO);
+    }
+
+    // Block numbers of the directory, in order
+    int *blocks = malloc(data_blocks * sizeof(int));
+    unsigned char *packed = calloc(data_blocks, EXT2_BLOCK_SIZE);
+    if (blocks == NULL || packed == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Pack every live entry into the scratch buffer.
+    // last is the most recently packed entry of the current output block,
+    // its rec_len is stretched to the end of the block once the block is full.
+    int out_block = 0;
+    int out_offset = 0;
+    struct ext2_dir_entry *last = NULL;
+    for (int i = 0; i < data_blocks; i++) {
+        STAT_ADD(dir_blocks_walked, 1);
+        if (i < 12) {
+            block_num = inode_table[dir_inode - 1].i_block[i];
+        } else {
+            indirect_idx = i - 12;
+            indirect_block = get_block(indirect_block_num);
+            memcpy(&block_num, indirect_block + (4 * indirect_idx), sizeof(int));
+            STAT_ADD(indirect_lookups, 1);
+        }
+        blocks[i] = block_num;
+
+        unsigned char *block = get_block(block_num);
+        struct ext2_dir_entry *curr;
+        int rec_len = 0;
+        while (rec_len < EXT2_BLOCK_SIZE) {
+            curr = (struct ext2_dir_entry *)(block + rec_len);
+            if (curr->rec_len == 0) {
+                break;
+            }
+            rec_len += curr->rec_len;
+            if (curr->inode == 0) {
+                continue;
+            }
+
+            int size = actual_rec_len(curr->name_len);
+            if (out_offset + size > DIR_BLOCK_END) {
+                last->rec_len += DIR_BLOCK_END - out_offset;
+                out_block++;
+                out_offset = 0;
+            }
+            last = (struct ext2_dir_entry *)(packed + EXT2_BLOCK_SIZE * out_block + out_offset);
+            memcpy(last, curr, sizeof(struct ext2_dir_entry) + curr->name_len);
+            last->rec_len = size;
+            out_offset += size;
+        }
+    }
+
+    // An empty directory still keeps its first block
+    if (last == NULL) {
+        last = (struct ext2_dir_entry *)packed;
+        last->rec_len = 0;
+    }
+    last->rec_len += DIR_BLOCK_END - out_offset;
+    int new_blocks = out_block + 1;
+
+    // Write the packed blocks back in place
+    for (int i = 0; i < new_blocks; i++) {
+        unsigned char *block = get_block(blocks[i]);
+        memcpy(block, packed + EXT2_BLOCK_SIZE * i, EXT2_BLOCK_SIZE);
+        init_dir_tail(block);
+        update_dir_csum(dir_inode, blocks[i]);
+    }
+
+    // Release the blocks that are no longer needed
+    int freed = 0;
+    if (new_blocks < data_blocks) {
+        unset_block_list(blocks + new_blocks, data_blocks - new_blocks);
+    }
+    for (int i = new_blocks; i < data_blocks; i++) {
+        if (i < 12) {
+            inode_table[dir_inode - 1].i_block[i] = 0;
+        }
+        freed++;
+    }
+    if (indirect_block_num != 0 && new_blocks <= 12) {
+        unset_bit(block_bitmap, indirect_block_num, BLOCK_BITMAP_SIZE);
+        inode_table[dir_inode - 1].i_block[12] = 0;
+        freed++;
+    }
+
+    inode_table[dir_inode - 1].i_size = new_blocks * EXT2_BLOCK_SIZE;
+    if (new_blocks > 12) {
+        inode_table[dir_inode - 1].i_blocks = (new_blocks + 1) * 2;
+    } else {
+        inode_table[dir_inode - 1].i_blocks = new_blocks * 2;
+    }
+    update_inode_csum(dir_inode);
+
+    free(blocks);
+    free(packed);
+    return freed;
+}
+
+// inode_block_list fills list, which must hold INODE_LIST_MAX entries, with
+// every block claimed by inode, in the order ext2_cp allocates them:
+// i_block[0..11], the indirect block, then the blocks the indirect block
+// points to.
+// It returns the number of blocks in the list, or -1 if the block map cannot
+// be walked: more blocks than one indirect block can hold, a double or triple
+// indirect block, or an indirect block outside the image. i_blocks is read
+// once, so a writer changing it under a read-only walk cannot push the list
+// past its end.
+int inode_block_list(int inode, int* list) {
+    struct ext2_inode *node = &inode_table[inode - 1];
+    int data_blocks = __atomic_load_n(&node->i_blocks, __ATOMIC_RELAXED) / 2;
+    if (data_blocks == 0) {
+        return 0;
+    }
+    if (data_blocks > INODE_LIST_MAX || node->i_block[13] != 0 || node->i_block[14] != 0) {
+        return -1;
+    }
+    unsigned int indirect_block_num = 0;
+    if (data_blocks > 12) {
+        indirect_block_num = __atomic_load_n(&node->i_block[12], __ATOMIC_RELAXED);
+        if (indirect_block_num == 0 || indirect_block_num >= sb->s_blocks_count) {
+            return -1;
+        }
+        data_blocks--;
+    }
+    int n = 0;
+    for (int i = 0; i < data_blocks; i++) {
+        if (i < 12) {
+            list[n++] = node->i_block[i];
+        } else {
+            if (i == 12) {
+                list[n++] = indirect_block_num;
+            }
+            int block_num;
+            memcpy(&block_num, get_block(indirect_block_num) + 4 * (i - 12), sizeof(int));
+            STAT_ADD(indirect_lookups, 1);
+            list[n++] = block_num;
+        }
+    }
+    return n;
+}
+
+// prefetch_inode reads the blocks of inode ahead of a walk over them, so the
+// indirect fan-out is fetched as one batch instead of one block at a time.
+// It returns -1 if the block map cannot be walked, so the walk is skipped.
+int prefetch_inode(int inode) {
+    int list[INODE_LIST_MAX];
+    int n = inode_block_list(inode, list);
+    if (n > 0) {
+        prefetch_blocks(list, n);
+    }
+    return n;
+}
+
+// count_fragments returns the number of contiguous runs that make up the
+// inode's block list. A file stored in one run has 1 fragment.
+int count_fragments(int inode) {
+    int list[INODE_LIST_MAX];
+    int n = inode_block_list(inode, list);
+    if (n <= 0) {
+        return 0;
+    }
+    int fragments = 1;
+    for (int i = 1; i < n; i++) {
+        if (list[i] != list[i - 1] + 1) {
+            fragments++;
+        }
+    }
+    return fragments;
+}
+
+// find_free_run looks for len consecutive free blocks, starting the search at
+// block goal and wrapping around to the first data block.
+// It returns the first block of the run, or 0 if there is no such run.
+int find_free_run(int len, int goal) {
+    int first = sb->s_first_data_block + 1;
+    int last = sb->s_blocks_count - 1;
+    if (goal < first || goal > last) {
+        goal = first;
+    }
+
+    int start = goal;
+    int run = 0;
+    int num = goal;
+    for (int scanned = 0; scanned <= last - first + len; scanned++) {
+        if (num > last) {
+            // Runs do not wrap around the end of the bitmap
+            num = first;
+            run = 0;
+        }
+        if (is_set(block_bitmap, num)) {
+            run = 0;
+        } else {
+            if (run == 0) {
+                start = num;
+            }
+            run++;
+            if (run == len) {
+                return start;
+            }
+        }
+        num++;
+    }
+    return 0;
+}
+
+// relocate_inode moves every block of inode into the free run starting at
+// block start (as found by find_free_run), copying the data, rewriting
+// i_block and the indirect block, and releasing the old blocks.
+void relocate_inode(int inode, int start) {
+    int list[INODE_LIST_MAX];
+    int n = inode_block_list(inode, list);
+    if (n <= 0) {
+        return;
+    }
+
+    // Claim the new run and copy the data over. The old blocks are read in
+    // one batch; the new ones are only written.
+    prefetch_blocks(list, n);
+    set_bit_range(block_bitmap, start, n, BLOCK_BITMAP_SIZE);
+    for (int i = 0; i < n; i++) {
+        unsigned char *old_block = get_block(list[i]);
+        memcpy(get_new_block(start + i), old_block, EXT2_BLOCK_SIZE);
+    }
+
+    // Rewrite the block map. In the list, the indirect block sits at index 12
+    // and the blocks it points to follow it.
+    unsigned char* indirect_block;
+    int block_num;
+    for (int i = 0; i < n; i++) {
+        if (i <= 12) {
+            inode_table[inode - 1].i_block[i] = start + i;
+        } else {
+            indirect_block = get_block(start + 12);
+            block_num = start + i;
+            memcpy(indirect_block + (4 * (i - 13)), &block_num, sizeof(int));
+            mark_dirty(start + 12);
+        }
+    }
+    update_inode_csum(inode);
+
+    unset_block_list(list, n);
+}
+
+// inode_in_use tells whether inode holds a live file: root, or an inode past
+// the reserved ones that is marked in the inode bitmap.
+int inode_in_use(int inode) {
+    if (inode == EXT2_ROOT_INO) {
+        return 1;
+    }
+    return inode >= EXT2_GOOD_OLD_FIRST_INO && is_set(inode_bitmap, inode);
+}
+
+// worker_threads returns how many threads a walk over items should use:
+// one per CPU when there are at least min items and the I/O backend can be
+// shared, one otherwise.
+int worker_threads(int items, int min) {
+    if (items < min || !io_thread_safe()) {
+        return 1;
+    }
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > HELPER_MAX_THREADS) {
+        threads = HELPER_MAX_THREADS;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    return threads;
+}
+
+struct owner_chunk {
+    struct owner_map *map;
+    int first;      // first inode of the chunk
+    int last;       // last inode of the chunk
+};
+
+// Claim the blocks of every in-use inode in the chunk. Claims are atomic,
+// so chunks can be walked by several threads at once.
+static void *claim_chunk(void *arg) {
+    struct owner_chunk *chunk = arg;
+    struct owner_map *map = chunk->map;
+    int list[INODE_LIST_MAX];
+    for (int inode = chunk->first; inode <= chunk->last; inode++) {
+        if (!inode_in_use(inode)) {
+            continue;
+        }
+        // Its blocks are unknown, so none of them are claimed
+        int n = inode_block_list(inode, list);
+        if (n < 0) {
+            __atomic_fetch_add(&map->unwalked_count, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            int block = list[i];
+            if (block <= 0 || block >= map->blocks_count) {
+                __atomic_fetch_add(&map->bad_count, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            int expected = OWNER_FREE;
+            if (!__atomic_compare_exchange_n(&map->owner[block], &expected, inode, 0,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&map->shared[block], 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+// build_owner_map maps every block of the image to the inode that owns it.
+// Large images are split into inode chunks walked in parallel when the I/O
+// backend allows it; otherwise the indirect blocks are prefetched in one
+// batch and the table is walked once.
+// Free the result with free_owner_map.
+struct owner_map *build_owner_map(void) {
+    struct owner_map *map = malloc(sizeof(struct owner_map));
+    if (map == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    map->blocks_count = sb->s_blocks_count;
+    map->owner = calloc(map->blocks_count, sizeof(int));
+    map->shared = calloc(map->blocks_count, 1);
+    if (map->owner == NULL || map->shared == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    map->shared_count = 0;
+    map->bad_count = 0;
+    map->unwalked_count = 0;
+
+    int inode_table_blocks = (sb->s_inodes_count * sizeof(struct ext2_inode) + EXT2_BLOCK_SIZE - 1)
+                             / EXT2_BLOCK_SIZE;
+    for (int i = sb->s_first_data_block; i < gd->bg_inode_table + inode_table_blocks; i++) {
+        map->owner[i] = OWNER_META;
+    }
+
+    int threads = worker_threads(sb->s_inodes_count, OWNER_MAP_PARALLEL_MIN);
+    struct owner_chunk chunks[HELPER_MAX_THREADS];
+    if (threads == 1) {
+        int *indirect_blocks = malloc(sb->s_inodes_count * sizeof(int));
+        if (indirect_blocks == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        int indirect_count = 0;
+        for (int inode = 1; inode <= sb->s_inodes_count; inode++) {
+            if (inode_in_use(inode) && inode_table[inode - 1].i_blocks / 2 > 12) {
+                indirect_blocks[indirect_count++] = inode_table[inode - 1].i_block[12];
+            }
+        }
+        prefetch_blocks(indirect_blocks, indirect_count);
+        free(indirect_blocks);
+
+        chunks[0].map = map;
+        chunks[0].first = 1;
+        chunks[0].last = sb->s_inodes_count;
+        claim_chunk(&chunks[0]);
+    } else {
+        pthread_t tids[HELPER_MAX_THREADS];
+        int per_thread = (sb->s_inodes_count + threads - 1) / threads;
+        for (int t = 0; t < threads; t++) {
+            chunks[t].map = map;
+            chunks[t].first = t * per_thread + 1;
+            chunks[t].last = (t + 1) * per_thread;
+            if (chunks[t].last > sb->s_inodes_count) {
+                chunks[t].last = sb->s_inodes_count;
+            }
+            if (pthread_create(&tids[t], NULL, claim_chunk, &chunks[t]) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+
+    for (int i = 0; i < map->blocks_count; i++) {
+        map->shared_count += map->shared[i];
+    }
+    return map;
+}
+
+void free_owner_map(struct owner_map *map) {
+    free(map->owner);
+    free(map->shared);
+    free(map);
+}
+
+// inode_type returns the EXT2_FT_* type of an inode's mode
+int inode_type(int inode) {
+    switch (inode_table[inode - 1].i_mode & 0xF000) {
+    case EXT2_S_IFDIR:
+        return EXT2_FT_DIR;
+    case EXT2_S_IFREG:
+        return EXT2_FT_REG_FILE;
+    case EXT2_S_IFLNK:
+        return EXT2_FT_SYMLINK;
+    default:
+        return EXT2_FT_UNKNOWN;
+    }
+}
+
+static void add_tree_entry(struct tree_entry **entries, int *count, int *capacity, int inode, char *path) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *entries = realloc(*entries, *capacity * sizeof(struct tree_entry));
+        if (*entries == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    (*entries)[*count].inode = inode;
+    (*entries)[*count].type = inode_type(inode);
+    (*entries)[*count].path = path;
+    (*count)++;
+}
+
+// walk_tree lists inode, found at path, and everything below it if it is a
+// directory, parents before their entries. Entries that do not look like
+// ones are skipped, so a walk of an image changing under a read-only open
+// stays in bounds. It returns the number of entries; free them with
+// free_tree.
+int walk_tree(char *path, int inode, struct tree_entry **entries) {
+    int count = 0;
+    int capacity = 0;
+    *entries = NULL;
+    char *root = strdup(path);
+    unsigned char *visited = calloc(sb->s_inodes_count + 1, 1);
+    if (root == NULL || visited == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    add_tree_entry(entries, &count, &capacity, inode, root);
+    visited[inode] = 1;
+
+    int list[INODE_LIST_MAX];
+    for (int k = 0; k < count; k++) {
+        int dir = (*entries)[k].inode;
+        if ((*entries)[k].type != EXT2_FT_DIR) {
+            continue;
+        }
+        int n = inode_block_list(dir, list);
+        prefetch_blocks(list, n);
+        for (int i = 0; i < n; i++) {
+            // The indirect block holds block numbers, not entries
+            if ((i == 12 && n > 12) || list[i] <= 0 || list[i] >= sb->s_blocks_count) {
+                continue;
+            }
+            STAT_ADD(dir_blocks_walked, 1);
+            unsigned char *block = get_block(list[i]);
+            int offset = 0;
+            while (offset < EXT2_BLOCK_SIZE) {
+                struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+                if (entry->rec_len < 8 || offset + entry->rec_len > EXT2_BLOCK_SIZE) {
+                    break;
+                }
+                offset += entry->rec_len;
+                int child = entry->inode;
+                if (child <= 0 || child > sb->s_inodes_count || entry->name_len + 8 > entry->rec_len
+                    || (entry->name_len == 1 && entry->name[0] == '.')
+                    || (entry->name_len == 2 && memcmp(entry->name, "..", 2) == 0)) {
+                    continue;
+                }
+                // A directory reached twice would be walked forever
+                if (visited[child] && inode_type(child) == EXT2_FT_DIR) {
+                    continue;
+                }
+                visited[child] = 1;
+                char *parent = (*entries)[k].path;
+                int len = strlen(parent);
+                char *child_path = malloc(len + entry->name_len + 2);
+                if (child_path == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+                // The root is the only path that already ends in a slash
+                sprintf(child_path, "%s%s%.*s", parent, parent[len - 1] == '/' ? "" : "/",
+                        entry->name_len, entry->name);
+                add_tree_entry(entries, &count, &capacity, child, child_path);
+            }
+        }
+    }
+    free(visited);
+    return count;
+}
+
+void free_tree(struct tree_entry *entries, int n) {
+    for (int i = 0; i < n; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+// referenced_inodes returns a bitmap, laid out like the inode bitmap, of
+// every inode named by an entry of an in-use directory. Directories are
+// found by sweeping the inode table, so each one is read exactly once.
+// The caller frees the result.
+unsigned char *referenced_inodes(void) {
+    // Padded to whole words for clear_unreferenced
+    unsigned char *referenced = calloc(INODE_BITMAP_SIZE + sizeof(unsigned long long), 1);
+    if (referenced == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    int list[INODE_LIST_MAX];
+    for (int dir = 1; dir <= sb->s_inodes_count; dir++) {
+        if (!inode_in_use(dir) || !IS_S_DIR(dir)) {
+            continue;
+        }
+        int n = inode_block_list(dir, list);
+        prefetch_blocks(list, n);
+        for (int i = 0; i < n; i++) {
+            // The indirect block holds block numbers, not entries
+            if (i == 12 && n > 12) {
+                continue;
+            }
+            if (list[i] <= 0 || list[i] >= sb->s_blocks_count) {
+                continue;
+            }
+            STAT_ADD(dir_blocks_walked, 1);
+            unsigned char *block = get_block(list[i]);
+            int offset = 0;
+            while (offset < EXT2_BLOCK_SIZE) {
+                struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+                if (entry->rec_len < 8 || offset + entry->rec_len > EXT2_BLOCK_SIZE) {
+                    break;
+                }
+                if (entry->inode > 0 && entry->inode <= sb->s_inodes_count) {
+                    referenced[(entry->inode - 1) / 8] |= 1 << ((entry->inode - 1) % 8);
+                }
+                offset += entry->rec_len;
+            }
+        }
+    }
+    return referenced;
+}
+
+// A slice of the inode table scanned for deleted inodes
+struct deleted_chunk {
+    int first;      // first inode of the chunk
+    int last;       // last inode of the chunk
+    int *found;     // deleted inodes found, from the chunk's own slot
+    int count;
+};
+
+// deleted_intact tells whether inode is a removed file or symlink whose
+// blocks are all still free, so its contents can be trusted.
+static int deleted_intact(int inode) {
+    struct ext2_inode *node = &inode_table[inode - 1];
+    int type = node->i_mode & 0xF000;
+    if (inode < EXT2_GOOD_OLD_FIRST_INO || is_set(inode_bitmap, inode) || node->i_dtime == 0
+        || node->i_links_count != 0 || (type != EXT2_S_IFREG && type != EXT2_S_IFLNK)) {
+        return 0;
+    }
+    // The indirect block is read for the rest of the list, so check it first
+    if (node->i_blocks / 2 > 12
+        && (node->i_block[12] <= 0 || node->i_block[12] >= sb->s_blocks_count
+            || is_set(block_bitmap, node->i_block[12]))) {
+        return 0;
+    }
+    int list[INODE_LIST_MAX];
+    int n = inode_block_list(inode, list);
+    if (n < 0) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (list[i] <= 0 || list[i] >= sb->s_blocks_count || is_set(block_bitmap, list[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void *scan_deleted_chunk(void *arg) {
+    struct deleted_chunk *chunk = arg;
+    for (int inode = chunk->first; inode <= chunk->last; inode++) {
+        if (deleted_intact(inode)) {
+            chunk->found[chunk->count++] = inode;
+        }
+    }
+    return NULL;
+}
+
+// written_inodes returns how many slots at the start of the inode table
+// may have been written. A lazily initialized table holds stale data past
+// the last slot ever handed out, which bg_itable_unused only tracks on
+// metadata_csum images; without it no free slot can be trusted.
+int written_inodes(void) {
+    if (!INODE_TABLE_LAZY) {
+        return sb->s_inodes_count;
+    }
+    if (!csum_enabled) {
+        return 0;
+    }
+    return sb->s_inodes_per_group - gd->bg_itable_unused;
+}
+
+// find_deleted_inodes fills found with every removed file or symlink whose
+// inode and blocks are all still free, in inode order, and returns how
+// many there are. found must hold s_inodes_count entries. Only the slots
+// written_inodes counts are scanned. Large tables are split into chunks
+// scanned in parallel when the I/O backend allows.
+int find_deleted_inodes(int *found) {
+    int inodes = written_inodes();
+    if (inodes == 0) {
+        return 0;
+    }
+    int threads = worker_threads(inodes, DELETED_SCAN_PARALLEL_MIN);
+    struct deleted_chunk chunks[HELPER_MAX_THREADS];
+    pthread_t tids[HELPER_MAX_THREADS];
+    int per_thread = (inodes + threads - 1) / threads;
+    for (int t = 0; t < threads; t++) {
+        // Each chunk fills the part of found that matches its inodes
+        chunks[t].first = t * per_thread + 1;
+        chunks[t].last = (t + 1) * per_thread < inodes ? (t + 1) * per_thread : inodes;
+        chunks[t].found = found + t * per_thread;
+        chunks[t].count = 0;
+        if (threads == 1) {
+            scan_deleted_chunk(&chunks[t]);
+        } else if (pthread_create(&tids[t], NULL, scan_deleted_chunk, &chunks[t]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    int count = 0;
+    for (int t = 0; t < threads; t++) {
+        if (threads > 1) {
+            pthread_join(tids[t], NULL);
+        }
+        memmove(found + count, chunks[t].found, chunks[t].count * sizeof(int));
+        count += chunks[t].count;
+    }
+    return count;
+}
+
+// The directories of one level of the link count walk, and the level
+// they discover.
+struct link_level {
+    int *links;             // entries naming each inode, indexed by inode
+    unsigned char *queued;  // directories already put on a level
+    int *dirs;
+    int first;              // chunk of dirs walked by one thread
+    int last;
+    int *next;
+    int *next_count;
+};
+
+// Count the entries of every directory in the chunk and queue the
+// subdirectories not seen before. Counts and the next level are updated
+// atomically, so chunks can be walked by several threads at once.
+static void *walk_level(void *arg) {
+    struct link_level *level = arg;
+    int list[INODE_LIST_MAX];
+    for (int d = level->first; d < level->last; d++) {
+        int dir = level->dirs[d];
+        int n = inode_block_list(dir, list);
+        for (int i = 0; i < n; i++) {
+            // The indirect block holds block numbers, not entries
+            if ((i == 12 && n > 12) || list[i] <= 0 || list[i] >= sb->s_blocks_count) {
+                continue;
+            }
+            unsigned char *block = get_block(list[i]);
+            int offset = 0;
+            while (offset < EXT2_BLOCK_SIZE) {
+                struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+                if (entry->rec_len < 8 || offset + entry->rec_len > EXT2_BLOCK_SIZE) {
+                    break;
+                }
+                int child = entry->inode;
+                offset += entry->rec_len;
+                if (child <= 0 || child > sb->s_inodes_count) {
+                    continue;
+                }
+                __atomic_fetch_add(&level->links[child], 1, __ATOMIC_RELAXED);
+                if (IS_S_DIR(child) && inode_in_use(child)
+                    && !__atomic_exchange_n(&level->queued[child], 1, __ATOMIC_RELAXED)) {
+                    int slot = __atomic_fetch_add(level->next_count, 1, __ATOMIC_RELAXED);
+                    level->next[slot] = child;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// count_links walks the directory tree once from root, a level at a time,
+// and returns the number of entries naming each inode, indexed by inode.
+// Including "." and "..", that is the link count ext2 expects. Inodes no
+// directory reaches count 0. Each level's blocks are prefetched together,
+// and large levels are split across threads when the I/O backend allows.
+// The caller frees the result.
+int *count_links(void) {
+    int *links = calloc(sb->s_inodes_count + 1, sizeof(int));
+    unsigned char *queued = calloc(sb->s_inodes_count + 1, 1);
+    // Every directory is queued at most once, so two flat arrays of the
+    // inode count hold any level and the one it discovers.
+    int *dirs = malloc(sb->s_inodes_count * sizeof(int));
+    int *next = malloc(sb->s_inodes_count * sizeof(int));
+    if (links == NULL || queued == NULL || dirs == NULL || next == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int count = 1;
+    dirs[0] = EXT2_ROOT_INO;
+    queued[EXT2_ROOT_INO] = 1;
+
+    int list[INODE_LIST_MAX];
+    while (count > 0) {
+        for (int d = 0; d < count; d++) {
+            int n = inode_block_list(dirs[d], list);
+            if (n > 0) {
+                STAT_ADD(dir_blocks_walked, n);
+                prefetch_blocks(list, n);
+            }
+        }
+
+        int next_count = 0;
+        int threads = worker_threads(count, LINK_SCAN_PARALLEL_MIN);
+        struct link_level chunks[HELPER_MAX_THREADS];
+        pthread_t tids[HELPER_MAX_THREADS];
+        int per_thread = (count + threads - 1) / threads;
+        for (int t = 0; t < threads; t++) {
+            chunks[t].links = links;
+            chunks[t].queued = queued;
+            chunks[t].dirs = dirs;
+            chunks[t].first = t * per_thread;
+            chunks[t].last = (t + 1) * per_thread < count ? (t + 1) * per_thread : count;
+            chunks[t].next = next;
+            chunks[t].next_count = &next_count;
+            if (threads == 1) {
+                walk_level(&chunks[t]);
+            } else if (pthread_create(&tids[t], NULL, walk_level, &chunks[t]) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for (int t = 0; t < threads && threads > 1; t++) {
+            pthread_join(tids[t], NULL);
+        }
+
+        int *swap = dirs;
+        dirs = next;
+        next = swap;
+        count = next_count;
+    }
+    free(queued);
+    free(dirs);
+    free(next);
+    return links;
+}
+
+// find_hidden_entries sweeps the rec_len gaps of every in-use directory
+// once and collects the removed entries still readable there, in
+// directory order. It returns the number found; the caller frees
+// *entries.
+int find_hidden_entries(struct hidden_entry **entries) {
+    int count = 0;
+    int capacity = 64;
+    *entries = malloc(capacity * sizeof(struct hidden_entry));
+    if (*entries == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int list[INODE_LIST_MAX];
+    for (int dir = 1; dir <= sb->s_inodes_count; dir++) {
+        if (!inode_in_use(dir) || !IS_S_DIR(dir)) {
+            continue;
+        }
+        int n = inode_block_list(dir, list);
+        prefetch_blocks(list, n);
+        for (int i = 0; i < n; i++) {
+            // The indirect block holds block numbers, not entries
+            if ((i == 12 && n > 12) || list[i] <= 0 || list[i] >= sb->s_blocks_count) {
+                continue;
+            }
+            STAT_ADD(dir_blocks_walked, 1);
+            unsigned char *block = get_block(list[i]);
+            int offset = 0;
+            while (offset < EXT2_BLOCK_SIZE) {
+                struct ext2_dir_entry *live = (struct ext2_dir_entry *)(block + offset);
+                if (live->rec_len < 8 || offset + live->rec_len > EXT2_BLOCK_SIZE) {
+                    break;
+                }
+                int end = offset + live->rec_len;
+                int gap = offset + actual_rec_len(live->name_len);
+                // Entries removed after this one are laid out back to back
+                while (gap + sizeof(struct ext2_dir_entry) <= end) {
+                    struct ext2_dir_entry *target = (struct ext2_dir_entry *)(block + gap);
+                    if (target->name_len == 0 || gap + actual_rec_len(target->name_len) > end) {
+                        break;
+                    }
+                    if (target->inode > 0 && target->inode <= sb->s_inodes_count) {
+                        if (count == capacity) {
+                            capacity *= 2;
+                            *entries = realloc(*entries, capacity * sizeof(struct hidden_entry));
+                            if (*entries == NULL) {
+                                perror("realloc");
+                                exit(1);
+                            }
+                        }
+                        struct hidden_entry *entry = &(*entries)[count++];
+                        entry->dir = dir;
+                        entry->block = list[i];
+                        entry->offset = gap;
+                        entry->inode = target->inode;
+                        memcpy(entry->name, target->name, target->name_len);
+                        entry->name[target->name_len] = '\0';
+                    }
+                    gap += actual_rec_len(target->name_len);
+                }
+                offset = end;
+            }
+        }
+    }
+    return count;
+}
+
+// unhide_entry makes a hidden entry live again by splitting the rec_len of
+// the live entry whose gap holds it. Earlier entries of the same gap may
+// have been unhidden already, so the covering entry is looked up again.
+void unhide_entry(struct hidden_entry *entry) {
+    unsigned char *block = get_block(entry->block);
+    int offset = 0;
+    while (offset < EXT2_BLOCK_SIZE) {
+        struct ext2_dir_entry *live = (struct ext2_dir_entry *)(block + offset);
+        if (live->rec_len < 8) {
+            break;
+        }
+        if (entry->offset < offset + live->rec_len) {
+            struct ext2_dir_entry *target = (struct ext2_dir_entry *)(block + entry->offset);
+            target->rec_len = offset + live->rec_len - entry->offset;
+            live->rec_len = entry->offset - offset;
+            update_dir_csum(entry->dir, entry->block);
+            return;
+        }
+        offset += live->rec_len;
+    }
+}
+
+// clear_unreferenced clears every set bit of bitmap whose bit in referenced
+// is unset, 64 bits at a time, and adjusts the free counts to match.
+// bits is the number of valid bits; padding bits past it are left alone.
+// It returns the number of bits cleared.
+int clear_unreferenced(unsigned char *bitmap, unsigned char *referenced, int bits) {
+    int cleared = 0;
+    int i = 0;
+    for (; i + 64 <= bits; i += 64) {
+        unsigned long long word;
+        unsigned long long keep;
+        memcpy(&word, bitmap + i / 8, sizeof(word));
+        memcpy(&keep, referenced + i / 8, sizeof(keep));
+        unsigned long long leaked = word & ~keep;
+        if (leaked != 0) {
+            cleared += __builtin_popcountll(leaked);
+            word &= keep;
+            memcpy(bitmap + i / 8, &word, sizeof(word));
+        }
+    }
+    for (; i < bits; i++) {
+        int mask = 1 << (i % 8);
+        if ((bitmap[i / 8] & mask) && !(referenced[i / 8] & mask)) {
+            bitmap[i / 8] &= ~mask;
+            cleared++;
+        }
+    }
+    if (bitmap == inode_bitmap) {
+        sb->s_free_inodes_count += cleared;
+        gd->bg_free_inodes_count += cleared;
+    } else if (bitmap == block_bitmap) {
+        sb->s_free_blocks_count += cleared;
+        gd->bg_free_blocks_count += cleared;
+    }
+    if (cleared > 0) {
+        update_bitmap_csum(bitmap);
+        update_group_csum();
+    }
+    return cleared;
+}
+
+/******************************************************************
+ * Metadata checksums, laid out as ext4's metadata_csum: crc32c of
+ * the superblock, the group descriptor, both bitmaps, every inode
+ * and every dir block (in a tail entry at its end), seeded from the
+ * volume uuid, without ext4's final inversion. The helpers that
+ * change one of these structures update its checksum right away.
+ * The SSE4.2 crc32 instruction does 8 bytes a step when the CPU has
+ * it; otherwise a slicing-by-8 table does.
+ ******************************************************************/
+int csum_enabled;
+static unsigned int csum_seed;
+static unsigned int crc32c_table[8][256];
+static int crc32c_hw = -1;      // -1 until probed
+
+static void crc32c_init(void) {
+    if (crc32c_hw != -1) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#else
+    crc32c_hw = 0;
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len) {
+    unsigned long long c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        unsigned long long word;
+        memcpy(&word, p, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    crc = c;
+    for (; len > 0; p++, len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+static unsigned int crc32c_sliced(unsigned int crc, const unsigned char *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        unsigned int lo;
+        unsigned int hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+              ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+              ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+              ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; len > 0; p++, len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
+
+// crc32c continues crc over len bytes of buf
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len) {
+    crc32c_init();
+#if defined(__x86_64__)
+    if (crc32c_hw) {
+        return crc32c_sse42(crc, buf, len);
+    }
+#endif
+    return crc32c_sliced(crc, buf, len);
+}
+
+// csum_init picks up whether the open image has metadata checksums.
+// open_image calls it.
+void csum_init(void) {
+    crc32c_init();
+    csum_enabled = (sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_METADATA_CSUM) != 0;
+    if (csum_enabled) {
+        csum_seed = crc32c(~0U, sb->s_uuid, sizeof(sb->s_uuid));
+    }
+}
+
+unsigned int superblock_csum(void) {
+    return crc32c(~0U, sb, offsetof(struct ext2_super_block, s_checksum));
+}
+
+// The descriptor is summed with its own checksum field zeroed
+unsigned short group_csum(void) {
+    struct ext2_group_desc desc = *gd;
+    desc.bg_checksum = 0;
+    unsigned int group = 0;
+    return crc32c(crc32c(csum_seed, &group, sizeof(group)), &desc, sizeof(desc)) & 0xFFFF;
+}
+
+// A bitmap is summed over the bits of one group
+unsigned short bitmap_csum(unsigned char *bitmap) {
+    int bits = bitmap == inode_bitmap ? sb->s_inodes_per_group : sb->s_blocks_per_group;
+    if (bits > EXT2_BLOCK_SIZE * 8) {
+        bits = EXT2_BLOCK_SIZE * 8;
+    }
+    return crc32c(csum_seed, bitmap, bits / 8) & 0xFFFF;
+}
+
+unsigned short inode_csum(int inode) {
+    struct ext2_inode node = inode_table[inode - 1];
+    node.i_checksum_lo = 0;
+    unsigned int crc = crc32c(csum_seed, &inode, sizeof(inode));
+    crc = crc32c(crc, &node.i_generation, sizeof(node.i_generation));
+    return crc32c(crc, &node, sizeof(node)) & 0xFFFF;
+}
+
+// dir_csum sums block, a block of directory dir_inode, up to its tail
+unsigned int dir_csum(int dir_inode, unsigned char *block) {
+    unsigned int crc = crc32c(csum_seed, &dir_inode, sizeof(dir_inode));
+    crc = crc32c(crc, &inode_table[dir_inode - 1].i_generation, sizeof(unsigned int));
+    return crc32c(crc, block, DIR_BLOCK_END);
+}
+
+// dir_tail returns the checksum tail of a dir block, or NULL if the
+// block does not end in one.
+struct ext2_dir_entry_tail *dir_tail(unsigned char *block) {
+    struct ext2_dir_entry_tail *tail = (struct ext2_dir_entry_tail *)(block + DIR_BLOCK_END);
+    if (tail->det_reserved_zero1 != 0 || tail->det_rec_len != sizeof(struct ext2_dir_entry_tail)
+        || tail->det_reserved_zero2 != 0 || tail->det_reserved_ft != EXT2_FT_DIR_CSUM) {
+        return NULL;
+    }
+    return tail;
+}
+
+// init_dir_tail ends a new dir block, whose entries stop at DIR_BLOCK_END,
+// with an empty checksum tail.
+void init_dir_tail(unsigned char *block) {
+    if (!csum_enabled) {
+        return;
+    }
+    struct ext2_dir_entry_tail *tail = (struct ext2_dir_entry_tail *)(block + DIR_BLOCK_END);
+    memset(tail, 0, sizeof(*tail));
+    tail->det_rec_len = sizeof(*tail);
+    tail->det_reserved_ft = EXT2_FT_DIR_CSUM;
+}
+
+// update_group_csum refreshes the group descriptor's and the superblock's
+// checksums after a change to either, such as a free count. Call it with
+// the counts lock held.
+void update_group_csum(void) {
+    if (csum_enabled) {
+        gd->bg_checksum = group_csum();
+        sb->s_checksum = superblock_csum();
+    }
+}
+
+// update_bitmap_csum refreshes a bitmap's checksum in the group
+// descriptor. The inode table's unused tail shrinks past the highest
+// inode in use, as ext4 expects. Call it with the bitmap's lock held; the
+// free count change that follows refreshes the descriptor's own checksum.
+// Threads running concurrently leave it to disable_concurrency.
+void update_bitmap_csum(unsigned char *bitmap) {
+    if (!csum_enabled || concurrent || (bitmap != block_bitmap && bitmap != inode_bitmap)) {
+        return;
+    }
+    if (bitmap == block_bitmap) {
+        gd->bg_block_bitmap_csum_lo = bitmap_csum(bitmap);
+        return;
+    }
+    gd->bg_inode_bitmap_csum_lo = bitmap_csum(bitmap);
+    int last = sb->s_inodes_per_group;
+    while (last > 0 && !is_set(inode_bitmap, last)) {
+        last--;
+    }
+    if (gd->bg_itable_unused > sb->s_inodes_per_group - last) {
+        gd->bg_itable_unused = sb->s_inodes_per_group - last;
+    }
+}
+
+// update_inode_csum refreshes an inode's checksum after a change to it
+void update_inode_csum(int inode) {
+    if (csum_enabled) {
+        inode_table[inode - 1].i_checksum_lo = inode_csum(inode);
+    }
+}
+
+// update_dir_csum refreshes the checksum of a changed block of directory
+// dir_inode and marks the block dirty, in place of mark_dirty.
+void update_dir_csum(int dir_inode, int block_num) {
+    if (csum_enabled) {
+        unsigned char *block = get_block(block_num);
+        struct ext2_dir_entry_tail *tail = dir_tail(block);
+        if (tail != NULL) {
+            tail->det_checksum = dir_csum(dir_inode, block);
+        }
+    }
+    mark_dirty(block_num);
+}
+
+// examine_csums checks every checksum against the metadata it covers and
+// rewrites the ones that are wrong. Run it after the other repairs, which
+// keep the checksums of what they change up to date themselves. It
+// returns the number of checksums fixed.
+int examine_csums(void) {
+    if (!csum_enabled) {
+        return 0;
+    }
+    int fixed = 0;
+    int list[INODE_LIST_MAX];
+    for (int i = 1; i <= sb->s_inodes_count; i++) {
+        if (!is_set(inode_bitmap, i)) {
+            continue;
+        }
+        unsigned short csum = inode_csum(i);
+        if (inode_table[i - 1].i_checksum_lo != csum) {
+            fprintf(stderr, "Fixed: inode [%d] checksum was %#x, should be %#x\n", i,
+                    inode_table[i - 1].i_checksum_lo, csum);
+            inode_table[i - 1].i_checksum_lo = csum;
+            fixed++;
+        }
+        if (i != EXT2_ROOT_INO && (i < EXT2_GOOD_OLD_FIRST_INO || inode_table[i - 1].i_links_count == 0
+                                   || !IS_S_DIR(i))) {
+            continue;
+        }
+        int n = inode_block_list(i, list);
+        if (n < 0) {
+            fprintf(stderr, "Found: dir inode [%d] has a corrupt block map, checksums not checked\n", i);
+            continue;
+        }
+        for (int j = 0; j < n; j++) {
+            // The indirect block is not a dir block
+            if (j == 12 || list[j] <= 0 || list[j] >= sb->s_blocks_count) {
+                continue;
+            }
+            unsigned char *block = get_block(list[j]);
+            struct ext2_dir_entry_tail *tail = dir_tail(block);
+            if (tail == NULL) {
+                fprintf(stderr, "Found: dir block [%d] of inode [%d] has no checksum tail\n", list[j], i);
+                continue;
+            }
+            unsigned int dcsum = dir_csum(i, block);
+            if (tail->det_checksum != dcsum) {
+                fprintf(stderr, "Fixed: dir block [%d] of inode [%d] checksum was %#x, should be %#x\n",
+                        list[j], i, tail->det_checksum, dcsum);
+                tail->det_checksum = dcsum;
+                mark_dirty(list[j]);
+                fixed++;
+            }
+        }
+    }
+    if (gd->bg_block_bitmap_csum_lo != bitmap_csum(block_bitmap)) {
+        fprintf(stderr, "Fixed: block bitmap checksum was %#x, should be %#x\n",
+                gd->bg_block_bitmap_csum_lo, bitmap_csum(block_bitmap));
+        fixed++;
+    }
+    if (gd->bg_inode_bitmap_csum_lo != bitmap_csum(inode_bitmap)) {
+        fprintf(stderr, "Fixed: inode bitmap checksum was %#x, should be %#x\n",
+                gd->bg_inode_bitmap_csum_lo, bitmap_csum(inode_bitmap));
+        fixed++;
+    }
+    counts_lock();
+    update_bitmap_csum(block_bitmap);
+    update_bitmap_csum(inode_bitmap);
+    if (gd->bg_checksum != group_csum()) {
+        fprintf(stderr, "Fixed: block group checksum was %#x, should be %#x\n", gd->bg_checksum, group_csum());
+        fixed++;
+    }
+    if (sb->s_checksum != superblock_csum()) {
+        fprintf(stderr, "Fixed: superblock checksum was %#x, should be %#x\n", sb->s_checksum, superblock_csum());
+        fixed++;
+    }
+    update_group_csum();
+    counts_unlock();
+    return fixed;
+}
+
+static double stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// stats_phase ends the current phase and starts the one called name.
+// Phases past STATS_MAX_PHASES are folded into the last one.
+void stats_phase(char *name) {
+    if (phase_count < STATS_MAX_PHASES) {
+        phase_names[phase_count] = name;
+        phase_starts[phase_count] = stats_now();
+        phase_count++;
+    }
+}
+
+// Print the phase times and the counters as one line of JSON on stderr.
+static void stats_report(void) {
+    double end = stats_now();
+    fprintf(stderr, "{\"tool\":\"%s\",\"total_us\":%.1f,\"phases\":{", tool_name, end - phase_starts[0]);
+    for (int i = 0; i < phase_count; i++) {
+        double phase_end = i + 1 < phase_count ? phase_starts[i + 1] : end;
+        fprintf(stderr, "%s\"%s\":%.1f", i ? "," : "", phase_names[i], phase_end - phase_starts[i]);
+    }
+    fprintf(stderr, "}");
+#ifndef EXT2_NO_STATS
+    fprintf(stderr, ",\"counters\":{\"bitmap_bits_scanned\":%ld,\"dir_blocks_walked\":%ld,"
+            "\"dir_entries_compared\":%ld,\"indirect_lookups\":%ld,\"block_lookups\":%ld,"
+            "\"block_reads\":%ld,\"block_writes\":%ld,\"io_batches\":%ld}",
+            stats.bitmap_bits_scanned, stats.dir_blocks_walked, stats.dir_entries_compared,
+            stats.indirect_lookups, stats.block_lookups, stats.block_reads, stats.block_writes,
+            stats.io_batches);
+#endif
+    fprintf(stderr, "}\n");
+}
+
+// stats_init starts the "args" phase and removes a --stats flag from argv.
+// With the flag, the stats are printed when the tool exits, including on
+// an error exit.
+void stats_init(int *argc, char **argv) {
+    tool_name = argv[0];
+    stats_phase("args");
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            for (int j = i; j < *argc; j++) {
+                argv[j] = argv[j + 1];
+            }
+            (*argc)--;
+            atexit(stats_report);
+            return;
+        }
+    }
+}
+
+// A copy from stdin is traced by trace_copied once its size is known
+static int trace_argc;
+static char **trace_argv;
+static long long trace_time;
+
+// Add the size of the native file source to a trace line's size field.
+// stdin_size stands for the source -.
+static void trace_size(char *sizes, int *len, char *source, long long stdin_size) {
+    if (*len >= TRACE_LINE_MAX) {
+        return;
+    }
+    struct stat st;
+    long long size = stdin_size;
+    if (strcmp(source, "-") != 0) {
+        size = stat(source, &st) == 0 ? st.st_size : 0;
+    }
+    *len += snprintf(sizes + *len, TRACE_LINE_MAX - *len, "%s%lld", *len ? "," : "", size);
+}
+
+// Append one line for the invocation to the trace file
+static void trace_write(char *trace, int argc, char **argv, long long time, long long stdin_size) {
+    char *tool = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+    if (strncmp(tool, "ext2_", 5) == 0) {
+        tool += 5;
+    }
+    int cp = strcmp(tool, "cp") == 0;
+
+    // Sources come before the destination, the last argument
+    char sizes[TRACE_LINE_MAX];
+    char args[TRACE_LINE_MAX];
+    int sizes_len = 0;
+    int args_len = 0;
+    sizes[0] = '\0';
+    for (int i = 2; i < argc && args_len < sizeof(args); i++) {
+        FILE *list_fp = NULL;
+        if (cp && i == 2 && strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            list_fp = fopen(argv[i + 1], "r");
+        }
+        if (list_fp != NULL) {
+            char *source = NULL;
+            size_t source_size = 0;
+            while (getline(&source, &source_size, list_fp) != -1 && args_len < sizeof(args)) {
+                source[strcspn(source, "\n")] = '\0';
+                if (source[0] != '\0') {
+                    trace_size(sizes, &sizes_len, source, stdin_size);
+                    args_len += snprintf(args + args_len, sizeof(args) - args_len, "\t%s", source);
+                }
+            }
+            free(source);
+            fclose(list_fp);
+            i++;
+            continue;
+        }
+        if (cp && i < argc - 1) {
+            trace_size(sizes, &sizes_len, argv[i], stdin_size);
+        }
+        args_len += snprintf(args + args_len, sizeof(args) - args_len, "\t%s", argv[i]);
+    }
+
+    char line[TRACE_LINE_MAX];
+    int len = snprintf(line, sizeof(line), "%lld\t%s\t%s%s", time, tool, sizes_len ? sizes : "0", args);
+    if (sizes_len >= sizeof(sizes) || args_len >= sizeof(args) || len >= sizeof(line) - 1) {
+        fprintf(stderr, "ERROR: command line too long to trace\n");
+        return;
+    }
+    line[len++] = '\n';
+
+    // One O_APPEND write per line keeps lines from concurrent tools whole
+    int fd = open(trace, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("open");
+        return;
+    }
+    if (write(fd, line, len) != len) {
+        perror("write");
+    }
+    close(fd);
+}
+
+// trace_op appends the tool invocation to the trace file named by the
+// EXT2_TRACE environment variable, if it is set. Each line holds, separated
+// by tabs: the wall clock time in microseconds, the tool name without its
+// ext2_ prefix, the sizes of the native source files (ext2_cp only, comma
+// separated in source order, 0 otherwise) and the tool's arguments after
+// the image file name. An ext2_cp file list is traced as the sources it
+// names, so the line stands on its own. A copy from stdin is only traced
+// by trace_copied, when the bytes it copied are known.
+// ext2_replay reads the same format.
+void trace_op(int argc, char **argv) {
+    char *trace = getenv("EXT2_TRACE");
+    trace_argv = NULL;
+    if (trace == NULL || argc < 2) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long time = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    char *tool = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+    if (strcmp(tool, "ext2_cp") == 0 && argc == 4 && strcmp(argv[2], "-") == 0) {
+        trace_argc = argc;
+        trace_argv = argv;
+        trace_time = time;
+        return;
+    }
+    trace_write(trace, argc, argv, time, 0);
+}
+
+// trace_copied traces a copy from stdin held back by trace_op, with the
+// number of bytes it copied. The time is still that of the start.
+void trace_copied(long long size) {
+    char *trace = getenv("EXT2_TRACE");
+    if (trace == NULL || trace_argv == NULL) {
+        return;
+    }
+    trace_write(trace, trace_argc, trace_argv, trace_time, size);
+    trace_argv = NULL;
+}
@@ -1,13 +1,15 @@
 #ifndef CSC369_EXT2_FS_HELPER
 #define CSC369_EXT2_FS_HELPER
 
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
-unsigned char *block_bitmap;
-unsigned char *inode_bitmap;
-struct ext2_inode *inode_table;
-int total_fixes;
+#include <stddef.h>
+
+extern unsigned char *disk;
+extern struct ext2_super_block *sb;
+extern struct ext2_group_desc *gd;
+extern unsigned char *block_bitmap;
+extern unsigned char *inode_bitmap;
+extern struct ext2_inode *inode_table;
+extern int total_fixes;
 
 #define IS_S_DIR(x)   (inode_table[x - 1].i_mode & EXT2_S_IFDIR)
 #define IS_S_FILE(x)   (inode_table[x - 1].i_mode & EXT2_S_IFREG)
@@ -16,15 +18,130 @@ int total_fixes;
 #define IS_FT_FILE(x)   (x == EXT2_FT_REG_FILE)
 #define IS_FT_LINK(x)   (x == EXT2_FT_SYMLINK)
 
+// Inode table slots that are not marked in the inode bitmap may hold stale
+// data when the image was made with a lazily initialized inode table.
+#define INODE_TABLE_LAZY (gd->bg_flags & EXT2_BG_INODE_LAZY)
+
 #define ABS_PATH 1
 #define REG_PATH 0
 
-#define BLOCK_BITMAP_SIZE 16
-#define INODE_BITMAP_SIZE 4
+// Bitmap sizes in bytes. The single block group covers every block after
+// s_first_data_block and every inode.
+#define BLOCK_BITMAP_SIZE ((sb->s_blocks_count - sb->s_first_data_block + 7) / 8)
+#define INODE_BITMAP_SIZE ((sb->s_inodes_count + 7) / 8)
+
+// Work counters for --stats. Building with -DEXT2_NO_STATS compiles them
+// out; --stats then reports the phase times only.
+struct ext2_stats {
+    long bitmap_bits_scanned;   // bits examined by find_next_available
+    long dir_blocks_walked;     // dir blocks visited by the dir entry helpers
+    long dir_entries_compared;  // names compared by check_exist
+    long indirect_lookups;      // block numbers read from indirect blocks
+    long block_lookups;         // get_block calls
+    long block_reads;           // blocks read by the cache backends
+    long block_writes;          // blocks written by the cache backends
+    long io_batches;            // batches handed to the I/O engine
+};
+
+// Concurrent writers (enable_concurrency): allocator slices per bitmap and
+// buckets of per-directory reader/writer locks
+#define ALLOC_SHARDS 16
+#define DIR_LOCK_BUCKETS 256
+extern int concurrent;
+
+#ifndef EXT2_NO_STATS
+extern struct ext2_stats stats;
+// Concurrent writers share the counters, so they add atomically
+#define STAT_ADD(counter, n) (concurrent ? (void)__atomic_fetch_add(&stats.counter, (n), __ATOMIC_RELAXED) \
+                                         : (void)(stats.counter += (n)))
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+
+#define STATS_MAX_PHASES 16
+
+// A removed entry still readable in the rec_len gap of a live entry
+struct hidden_entry {
+    int dir;            // directory inode holding the entry
+    int block;          // directory block holding the entry
+    int offset;         // offset of the entry in the block
+    int inode;
+    char name[256];     // up to EXT2_NAME_LEN, NUL terminated
+};
+
+// Block -> owning inode, built in one pass over the inode table.
+// owner[b] is the inode that claims block b (as a data or indirect block),
+// OWNER_FREE if no inode does and OWNER_META for the superblock, group
+// descriptor, bitmaps and inode table. Blocks claimed more than once keep
+// their first claimer in owner and are flagged in shared.
+struct owner_map {
+    int *owner;
+    unsigned char *shared;
+    int blocks_count;
+    int shared_count;       // blocks claimed by two or more inodes
+    int bad_count;          // claimed block numbers outside the image
+    int unwalked_count;     // in-use inodes whose block map cannot be walked
+};
+
+// Entries of a list filled by inode_block_list: twelve direct blocks, the
+// indirect block and the blocks it points to
+#define INODE_LIST_MAX (EXT2_BLOCK_SIZE / 4 + 13)
+
+// A file or directory found by walk_tree
+struct tree_entry {
+    int inode;
+    int type;           // EXT2_FT_*, from the inode's mode
+    char *path;
+};
+
+#define OWNER_FREE 0
+#define OWNER_META -1
+// Below this many inodes the map is built on one thread
+#define OWNER_MAP_PARALLEL_MIN 2048
+// Below this many inodes the deleted inode scan runs on one thread
+#define DELETED_SCAN_PARALLEL_MIN 2048
+// Below this many directories a level of the link count walk runs on one thread
+#define LINK_SCAN_PARALLEL_MIN 64
+// Below this many sources ext2_cp copies the data on one thread
+#define CP_PARALLEL_MIN 4
+// A single ext2_cp reads ahead of the image writes into a ring of
+// CP_RING_SLOTS slots of CP_SLOT_BLOCKS blocks each
+#define CP_RING_SLOTS 4
+#define CP_SLOT_BLOCKS 16
+// Below this many files ext2_sum hashes on one thread
+#define SUM_PARALLEL_MIN 4
+#define HELPER_MAX_THREADS 16
+
+// Longest line trace_op writes, newline included
+#define TRACE_LINE_MAX 4096
+
+// Metadata checksums (metadata_csum): crc32c's reversed polynomial. Dir
+// entries end at DIR_BLOCK_END, before the checksum tail if there is one.
+#define CRC32C_POLY 0x82F63B78
+extern int csum_enabled;
+#define DIR_BLOCK_END (EXT2_BLOCK_SIZE - (csum_enabled ? (int)sizeof(struct ext2_dir_entry_tail) : 0))
 
 int find_next_available(unsigned char *bitmap, int size);
+int enable_concurrency(void);
+void disable_concurrency(void);
+void dir_read_lock(int inode);
+void dir_write_lock(int inode);
+void dir_unlock(int inode);
+void counts_lock(void);
+void counts_unlock(void);
+void bitmap_lock(unsigned char *bitmap);
+void bitmap_unlock(unsigned char *bitmap);
+void inode_lock(int inode, int write);
+void inode_unlock(int inode);
+void links_lock(int inode);
+void links_unlock(int inode);
+void add_used_dirs(int delta);
 void set_bit(unsigned char* bitmap, int num, int size);
 void unset_bit(unsigned char* bitmap, int num, int size);
+void set_bit_range(unsigned char* bitmap, int num, int count, int size);
+void unset_bit_range(unsigned char* bitmap, int num, int count, int size);
+void set_block_list(int* list, int n);
+void unset_block_list(int* list, int n);
 int is_set(unsigned char* bitmap, int num);
 int actual_rec_len(int name_len);
 int check_exist(char* dir_name, int inode);
@@ -33,10 +150,50 @@ void validate_path(char* path, int flag);
 void insert_dir_entry(int new_inode, char* name, int inode, int type);
 void remove_dir_entry(int inode, char* name, int parent_inode);
 void cleanup_inode(int inode);
+void release_inodes(int *inodes, int n);
 void remove_dir(int dir_inode, char* name, int parent_inode);
 int check_restore(char* name, int parent_inode);
+void unhide_restored(char* name, int parent_inode);
 void restore_dir_entry(int inode, char* name, int parent_inode);
 void restore_dir(int dir_inode, char* name, int parent_inode);
 void examine_dir_inode(int dir_inode);
+int compact_dir(int dir_inode);
+int inode_block_list(int inode, int* list);
+int prefetch_inode(int inode);
+int count_fragments(int inode);
+int find_free_run(int len, int goal);
+void relocate_inode(int inode, int start);
+struct owner_map *build_owner_map(void);
+void free_owner_map(struct owner_map *map);
+int inode_type(int inode);
+int walk_tree(char *path, int inode, struct tree_entry **entries);
+void free_tree(struct tree_entry *entries, int n);
+int inode_in_use(int inode);
+unsigned char *referenced_inodes(void);
+int *count_links(void);
+int written_inodes(void);
+int find_deleted_inodes(int *found);
+int find_hidden_entries(struct hidden_entry **entries);
+void unhide_entry(struct hidden_entry *entry);
+int clear_unreferenced(unsigned char *bitmap, unsigned char *referenced, int bits);
+int worker_threads(int items, int min);
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+void csum_init(void);
+unsigned int superblock_csum(void);
+unsigned short group_csum(void);
+unsigned short bitmap_csum(unsigned char *bitmap);
+unsigned short inode_csum(int inode);
+unsigned int dir_csum(int dir_inode, unsigned char *block);
+struct ext2_dir_entry_tail *dir_tail(unsigned char *block);
+void init_dir_tail(unsigned char *block);
+void update_group_csum(void);
+void update_bitmap_csum(unsigned char *bitmap);
+void update_inode_csum(int inode);
+void update_dir_csum(int dir_inode, int block_num);
+int examine_csums(void);
+void stats_init(int *argc, char **argv);
+void stats_phase(char *name);
+void trace_op(int argc, char **argv);
+void trace_copied(long long size);
 
 #endif
\ No newline at end of file
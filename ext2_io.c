@@ -0,0 +1,1037 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+static struct io_backend *backend;
+static int image_fd = -1;
+static long long image_size;
+// Number of blocks from the boot block through the end of the inode table
+static int meta_blocks;
+
+// Cross-process locking state, see share_image
+static int share_requested;
+static int shared;
+struct held_range {
+    long long offset;
+    long long len;
+    int depth;          // takes not yet matched by an unlock_range
+    int ready;          // the lock has been granted
+    int write;          // a write lock rather than a read lock
+};
+static struct held_range held_ranges[IO_MAX_HELD_RANGES];
+static pthread_mutex_t held_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t held_cond = PTHREAD_COND_INITIALIZER;
+
+// Images kept open across open_image/close_image pairs, see hold_image
+struct held_image {
+    char *path;
+    int fd;
+    long long size;
+    int meta_blocks;
+    unsigned char *disk;
+    unsigned char *seq_page;
+};
+static struct held_image held_images[IO_MAX_HELD_IMAGES];
+static int held_count;
+static struct held_image *current_held;
+
+// Writer generations, see struct image_seq
+static int read_only;               // opened with open_image_readonly
+static struct image_seq *seq;
+static unsigned char *seq_page;     // a writer's shared mapping of seq
+static int writing;                 // begun bumped, done not yet
+static int write_end_registered;
+// What a reader gets for a block number outside the image
+static unsigned char zero_block[EXT2_BLOCK_SIZE];
+
+// Read/write count blocks starting at block_num, retrying short transfers.
+static void read_blocks(unsigned char *buf, int block_num, int count) {
+    long long offset = (long long)block_num * EXT2_BLOCK_SIZE;
+    long long len = (long long)count * EXT2_BLOCK_SIZE;
+    while (len > 0) {
+        ssize_t n = pread(image_fd, buf, len, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            perror("pread");
+            exit(1);
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+static void write_blocks(unsigned char *buf, int block_num, int count) {
+    long long offset = (long long)block_num * EXT2_BLOCK_SIZE;
+    long long len = (long long)count * EXT2_BLOCK_SIZE;
+    while (len > 0) {
+        ssize_t n = pwrite(image_fd, buf, len, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            perror("pwrite");
+            exit(1);
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/******************************************************************
+ * mmap backend: the whole image is mapped MAP_SHARED.
+ * Small images are prefaulted whole with MAP_POPULATE; larger ones
+ * only get the metadata region prefaulted, so the tools do not take
+ * a fault on first touch of sb, gd, the bitmaps or the inode table.
+ ******************************************************************/
+// Round the byte range of count blocks at block_num out to whole pages
+static void page_range(int block_num, int count, char **addr, size_t *len) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long start = (unsigned long)(disk + (long long)block_num * EXT2_BLOCK_SIZE);
+    unsigned long end = start + (unsigned long)count * EXT2_BLOCK_SIZE;
+    start &= ~(page_size - 1);
+    *addr = (char *)start;
+    *len = end - start;
+}
+
+static void mmap_open(int fd, long long size) {
+    int flags = MAP_SHARED;
+    if (size <= IO_POPULATE_LIMIT) {
+        flags |= MAP_POPULATE;
+    }
+    disk = mmap(NULL, size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, flags, fd, 0);
+    if(disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    // The hints below are best effort; failures are ignored.
+    char *addr;
+    size_t len;
+    char *hugepage = getenv("EXT2_IO_HUGEPAGE");
+    if (hugepage != NULL && strcmp(hugepage, "1") == 0) {
+        madvise(disk, size, MADV_HUGEPAGE);
+    }
+    if (size > IO_POPULATE_LIMIT) {
+        page_range(0, meta_blocks, &addr, &len);
+        // Prefault the page tables too where the kernel supports it,
+        // otherwise just start reading the region in. Read faults only:
+        // a write prefault would dirty the whole region for writeback.
+        if (madvise(addr, len, MADV_POPULATE_READ) == -1) {
+            madvise(addr, len, MADV_WILLNEED);
+        }
+    }
+}
+
+static unsigned char *mmap_block(int block_num) {
+    return disk + EXT2_BLOCK_SIZE * block_num;
+}
+
+static unsigned char *mmap_new_block(int block_num) {
+    unsigned char *block = disk + EXT2_BLOCK_SIZE * block_num;
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    return block;
+}
+
+// Start reading the blocks in, one madvise per contiguous run. Long runs
+// are also marked sequential so the kernel reads further ahead in them.
+static void mmap_prefetch(int *blocks, int n) {
+    // Already populated by mmap_open
+    if (image_size <= IO_POPULATE_LIMIT) {
+        return;
+    }
+    char *addr;
+    size_t len;
+    int i = 0;
+    while (i < n) {
+        int run = 1;
+        while (i + run < n && blocks[i + run] == blocks[i] + run) {
+            run++;
+        }
+        if (blocks[i] > 0 && blocks[i] + run <= image_size / EXT2_BLOCK_SIZE) {
+            page_range(blocks[i], run, &addr, &len);
+            if (run >= IO_SEQUENTIAL_RUN) {
+                madvise(addr, len, MADV_SEQUENTIAL);
+            }
+            madvise(addr, len, MADV_WILLNEED);
+        }
+        i += run;
+    }
+}
+
+static void mmap_dirty(int block_num) {
+}
+
+static void mmap_flush(void) {
+}
+
+static void mmap_close(void) {
+    int ret = munmap(disk, image_size);
+    if (ret == -1) {
+        perror("munmap");
+        exit(1);
+    }
+}
+
+struct io_backend mmap_backend = {
+    "mmap", mmap_open, mmap_block, mmap_new_block, mmap_prefetch,
+    mmap_dirty, mmap_flush, mmap_close
+};
+
+/******************************************************************
+ * Block transfers. The cache backends hand batches of block reads
+ * and writes to an engine: one pread/pwrite at a time, or io_uring.
+ ******************************************************************/
+struct io_request {
+    unsigned char *buf;
+    int block_num;
+    int write;
+};
+
+static void sync_submit(struct io_request *reqs, int n) {
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].write) {
+            write_blocks(reqs[i].buf, reqs[i].block_num, 1);
+        } else {
+            read_blocks(reqs[i].buf, reqs[i].block_num, 1);
+        }
+    }
+}
+
+static void (*engine_submit)(struct io_request *reqs, int n) = sync_submit;
+
+static void submit_requests(struct io_request *reqs, int n) {
+    STAT_ADD(io_batches, 1);
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].write) {
+            STAT_ADD(block_writes, 1);
+        } else {
+            STAT_ADD(block_reads, 1);
+        }
+    }
+    engine_submit(reqs, n);
+}
+
+/******************************************************************
+ * cache backend: the metadata region is read into memory once and
+ * every other block goes through an LRU cache of IO_CACHE_BLOCKS
+ * blocks (EXT2_IO_CACHE_BLOCKS overrides it), read with pread and
+ * written back with pwrite.
+ ******************************************************************/
+struct cache_slot {
+    int block_num;          // -1 when the slot is empty
+    int dirty;
+    unsigned long last_used;
+    unsigned char data[EXT2_BLOCK_SIZE];
+};
+
+static struct cache_slot *cache;
+static int cache_blocks;
+// Block number -> cache slot, -1 when the block is not cached
+static int *cache_index;
+static unsigned long cache_tick;
+// The metadata region as last read from/written to the image
+static unsigned char *meta_clean;
+// Scratch space for building a batch of requests: write-backs fill it from
+// the front, prefetch reads from the back
+static struct io_request *batch;
+static int batch_size;
+
+static void cache_open(int fd, long long size) {
+    int blocks_count = size / EXT2_BLOCK_SIZE;
+    cache_blocks = IO_CACHE_BLOCKS;
+    char *env = getenv("EXT2_IO_CACHE_BLOCKS");
+    if (env != NULL && atoi(env) > IO_CACHE_BLOCKS) {
+        cache_blocks = atoi(env);
+    }
+
+    disk = malloc(meta_blocks * EXT2_BLOCK_SIZE);
+    meta_clean = malloc(meta_blocks * EXT2_BLOCK_SIZE);
+    cache = malloc(cache_blocks * sizeof(struct cache_slot));
+    cache_index = malloc(blocks_count * sizeof(int));
+    batch_size = cache_blocks + cache_blocks / 2 + meta_blocks;
+    batch = malloc(batch_size * sizeof(struct io_request));
+    if (disk == NULL || meta_clean == NULL || cache == NULL || cache_index == NULL || batch == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    read_blocks(disk, 0, meta_blocks);
+    memcpy(meta_clean, disk, meta_blocks * EXT2_BLOCK_SIZE);
+    for (int i = 0; i < cache_blocks; i++) {
+        cache[i].block_num = -1;
+        cache[i].dirty = 0;
+        cache[i].last_used = 0;
+    }
+    for (int i = 0; i < blocks_count; i++) {
+        cache_index[i] = -1;
+    }
+    cache_tick = 0;
+}
+
+// Write every dirty cached block back to the image as one batch.
+static void cache_write_back(void) {
+    int n = 0;
+    for (int i = 0; i < cache_blocks; i++) {
+        if (cache[i].block_num != -1 && cache[i].dirty) {
+            batch[n].buf = cache[i].data;
+            batch[n].block_num = cache[i].block_num;
+            batch[n].write = 1;
+            n++;
+            cache[i].dirty = 0;
+        }
+    }
+    if (n > 0) {
+        submit_requests(batch, n);
+    }
+}
+
+static void check_range(int block_num) {
+    if (block_num <= 0 || block_num >= image_size / EXT2_BLOCK_SIZE) {
+        fprintf(stderr, "ERROR: block %d is outside the image\n", block_num);
+        exit(EIO);
+    }
+}
+
+// Take the least recently used slot for block_num, without reading it.
+// A dirty victim makes every dirty block go back to the image in one batch,
+// so evictions turn into batched write-behind.
+static int cache_take_slot(int block_num) {
+    int slot = 0;
+    for (int i = 1; i < cache_blocks; i++) {
+        if (cache[i].last_used < cache[slot].last_used) {
+            slot = i;
+        }
+    }
+    if (cache[slot].block_num != -1) {
+        if (cache[slot].dirty) {
+            cache_write_back();
+        }
+        cache_index[cache[slot].block_num] = -1;
+    }
+    cache[slot].block_num = block_num;
+    cache[slot].dirty = 0;
+    cache[slot].last_used = ++cache_tick;
+    cache_index[block_num] = slot;
+    return slot;
+}
+
+static unsigned char *cache_block(int block_num) {
+    if (block_num < meta_blocks) {
+        return disk + EXT2_BLOCK_SIZE * block_num;
+    }
+    check_range(block_num);
+
+    int slot = cache_index[block_num];
+    if (slot == -1) {
+        slot = cache_take_slot(block_num);
+        batch[0].buf = cache[slot].data;
+        batch[0].block_num = block_num;
+        batch[0].write = 0;
+        submit_requests(batch, 1);
+    }
+    cache[slot].last_used = ++cache_tick;
+    return cache[slot].data;
+}
+
+static unsigned char *cache_new_block(int block_num) {
+    if (block_num < meta_blocks) {
+        return disk + EXT2_BLOCK_SIZE * block_num;
+    }
+    check_range(block_num);
+
+    int slot = cache_index[block_num];
+    if (slot == -1) {
+        slot = cache_take_slot(block_num);
+    }
+    cache[slot].last_used = ++cache_tick;
+    cache[slot].dirty = 1;
+    memset(cache[slot].data, 0, EXT2_BLOCK_SIZE);
+    return cache[slot].data;
+}
+
+// Read the blocks that are not cached yet as one batch. At most half of
+// the cache is used, so blocks fetched just before stay cached.
+static void cache_prefetch(int *blocks, int n) {
+    if (n > cache_blocks / 2) {
+        n = cache_blocks / 2;
+    }
+    int reads = 0;
+    for (int i = 0; i < n; i++) {
+        if (blocks[i] < meta_blocks || blocks[i] >= image_size / EXT2_BLOCK_SIZE ||
+            cache_index[blocks[i]] != -1) {
+            continue;
+        }
+        // A write-back in cache_take_slot reuses batch, so the reads are
+        // queued from the other end.
+        int slot = cache_take_slot(blocks[i]);
+        struct io_request *req = &batch[batch_size - 1 - reads];
+        req->buf = cache[slot].data;
+        req->block_num = blocks[i];
+        req->write = 0;
+        reads++;
+    }
+    if (reads > 0) {
+        submit_requests(&batch[batch_size - reads], reads);
+    }
+}
+
+static void cache_dirty(int block_num) {
+    // Metadata blocks are compared against meta_clean on flush instead
+    if (block_num < meta_blocks) {
+        return;
+    }
+    int slot = cache_index[block_num];
+    if (slot != -1) {
+        cache[slot].dirty = 1;
+    }
+}
+
+static void cache_flush(void) {
+    cache_write_back();
+    int n = 0;
+    for (int i = 0; i < meta_blocks; i++) {
+        unsigned char *block = disk + EXT2_BLOCK_SIZE * i;
+        unsigned char *clean = meta_clean + EXT2_BLOCK_SIZE * i;
+        if (memcmp(block, clean, EXT2_BLOCK_SIZE) != 0) {
+            batch[n].buf = block;
+            batch[n].block_num = i;
+            batch[n].write = 1;
+            n++;
+            memcpy(clean, block, EXT2_BLOCK_SIZE);
+        }
+    }
+    if (n > 0) {
+        submit_requests(batch, n);
+    }
+}
+
+static void cache_close(void) {
+    free(disk);
+    free(meta_clean);
+    free(cache);
+    free(cache_index);
+    free(batch);
+}
+
+struct io_backend cache_backend = {
+    "cache", cache_open, cache_block, cache_new_block, cache_prefetch,
+    cache_dirty, cache_flush, cache_close
+};
+
+/******************************************************************
+ * uring backend: the cache backend, with every batch of reads and
+ * writes queued on an io_uring and completed together. Falls back
+ * to pread/pwrite when io_uring is not available.
+ ******************************************************************/
+#define URING_ENTRIES 128
+
+static int ring_fd = -1;
+static void *sq_ring;
+static void *cq_ring;
+static size_t sq_ring_size;
+static size_t cq_ring_size;
+static struct io_uring_sqe *sqes;
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned ring_entries;
+
+// Set up the ring. It returns -1 if io_uring is unavailable.
+static int uring_setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_fd < 0) {
+        return -1;
+    }
+    ring_entries = params.sq_entries;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size) {
+            sq_ring_size = cq_ring_size;
+        }
+        cq_ring_size = sq_ring_size;
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        close(ring_fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+            close(ring_fd);
+            return -1;
+        }
+    }
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+        return -1;
+    }
+
+    sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+// Queue up to ring_entries requests at a time and wait for all of them.
+// A request the ring could not complete in full is redone with pread/pwrite.
+static void uring_submit(struct io_request *reqs, int n) {
+    for (int done = 0; done < n; ) {
+        int count = n - done;
+        if (count > ring_entries) {
+            count = ring_entries;
+        }
+
+        unsigned tail = *sq_tail;
+        for (int i = 0; i < count; i++) {
+            struct io_request *req = &reqs[done + i];
+            unsigned idx = tail & *sq_mask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = image_fd;
+            sqe->addr = (unsigned long)req->buf;
+            sqe->len = EXT2_BLOCK_SIZE;
+            sqe->off = (unsigned long long)req->block_num * EXT2_BLOCK_SIZE;
+            sqe->user_data = done + i;
+            sq_array[idx] = idx;
+            tail++;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        int submitted = 0;
+        int completed = 0;
+        while (completed < count) {
+            int ret = syscall(__NR_io_uring_enter, ring_fd, count - submitted, count - completed,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            } else if (ret < 0) {
+                perror("io_uring_enter");
+                exit(1);
+            }
+            submitted += ret;
+
+            unsigned head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                if (cqe->res != EXT2_BLOCK_SIZE) {
+                    sync_submit(&reqs[cqe->user_data], 1);
+                }
+                head++;
+                completed++;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        done += count;
+    }
+}
+
+static void uring_open(int fd, long long size) {
+    cache_open(fd, size);
+    if (uring_setup() == 0) {
+        engine_submit = uring_submit;
+    } else {
+        ring_fd = -1;
+        engine_submit = sync_submit;
+    }
+}
+
+static void uring_close(void) {
+    cache_close();
+    if (ring_fd != -1) {
+        munmap(sqes, ring_entries * sizeof(struct io_uring_sqe));
+        if (cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    engine_submit = sync_submit;
+}
+
+struct io_backend uring_backend = {
+    "uring", uring_open, cache_block, cache_new_block, cache_prefetch,
+    cache_dirty, cache_flush, uring_close
+};
+
+/******************************************************************
+ * Cross-process locks: OFD byte-range locks on the image file. They
+ * belong to the open image, so the threads of a tool share them, and
+ * closing the image drops them all.
+ ******************************************************************/
+// Wait for a lock of type (or F_UNLCK) on len bytes from offset; len 0
+// runs to the end of the file and beyond.
+static void set_lock(long long offset, long long len, short type) {
+    struct flock fl = { .l_type = type, .l_whence = SEEK_SET, .l_start = offset, .l_len = len };
+    while (fcntl(image_fd, F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            perror("fcntl");
+            exit(1);
+        }
+    }
+}
+
+static void forget_locks(void) {
+    shared = 0;
+    memset(held_ranges, 0, sizeof(held_ranges));
+}
+
+// Give back the ranges a tool still holds on an image that stays open,
+// as after an error exit.
+static void drop_ranges(void) {
+    for (int i = 0; i < IO_MAX_HELD_RANGES; i++) {
+        if (held_ranges[i].depth > 0) {
+            set_lock(held_ranges[i].offset, held_ranges[i].len, F_UNLCK);
+        }
+    }
+    memset(held_ranges, 0, sizeof(held_ranges));
+}
+
+// share_image asks the next open_image to share the image with other
+// processes. Without it the whole image is locked until it is closed; with
+// it only IO_LOCK_SESSION is, shared, and the tool locks just the ranges
+// it changes with lock_range.
+void share_image(void) {
+    share_requested = 1;
+}
+
+// image_shared tells whether the open image is shared. Sharing needs the
+// mmap backend; the other backends lock the whole image regardless.
+int image_shared(void) {
+    return shared;
+}
+
+// lock_range waits for a read or write lock on len bytes from offset, if
+// the image is shared. A range taken again while held only counts the
+// take, so helpers and threads can nest. A nested take must ask for the
+// same length and no more than the held type: a read lock is not upgraded,
+// since two processes upgrading the same range would wait on each other
+// forever.
+void lock_range(long long offset, long long len, int write) {
+    if (!shared) {
+        return;
+    }
+    pthread_mutex_lock(&held_mutex);
+    struct held_range *slot = NULL;
+    for (int i = 0; i < IO_MAX_HELD_RANGES; i++) {
+        if (held_ranges[i].depth > 0 && held_ranges[i].offset == offset) {
+            if (held_ranges[i].len != len || (write && !held_ranges[i].write)) {
+                pthread_mutex_unlock(&held_mutex);
+                fprintf(stderr, "ERROR: image range %lld is already locked for %s of %lld bytes\n",
+                        offset, held_ranges[i].write ? "writing" : "reading", held_ranges[i].len);
+                exit(1);
+            }
+            held_ranges[i].depth++;
+            while (!held_ranges[i].ready) {
+                pthread_cond_wait(&held_cond, &held_mutex);
+            }
+            pthread_mutex_unlock(&held_mutex);
+            return;
+        }
+        if (held_ranges[i].depth == 0 && slot == NULL) {
+            slot = &held_ranges[i];
+        }
+    }
+    if (slot == NULL) {
+        fprintf(stderr, "ERROR: too many image ranges locked\n");
+        exit(1);
+    }
+    slot->offset = offset;
+    slot->len = len;
+    slot->depth = 1;
+    slot->ready = 0;
+    slot->write = write;
+    pthread_mutex_unlock(&held_mutex);
+    set_lock(offset, len, write ? F_WRLCK : F_RDLCK);
+    pthread_mutex_lock(&held_mutex);
+    slot->ready = 1;
+    pthread_cond_broadcast(&held_cond);
+    pthread_mutex_unlock(&held_mutex);
+}
+
+// unlock_range matches one lock_range of the same range
+void unlock_range(long long offset, long long len) {
+    if (!shared) {
+        return;
+    }
+    pthread_mutex_lock(&held_mutex);
+    for (int i = 0; i < IO_MAX_HELD_RANGES; i++) {
+        if (held_ranges[i].depth > 0 && held_ranges[i].offset == offset) {
+            if (--held_ranges[i].depth == 0) {
+                set_lock(offset, len, F_UNLCK);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&held_mutex);
+}
+
+/******************************************************************
+ * Writer generations. Readers of an image opened with
+ * open_image_readonly take no locks; they compare the counters of
+ * struct image_seq before and after reading instead.
+ ******************************************************************/
+// Map the counters of the open image and mark this process as a live
+// writer. A writer that finds no other writer alive first clears what a
+// writer that died mid-operation left behind.
+static void map_seq(void) {
+    seq_page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+    if (seq_page == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    seq = (struct image_seq *)(seq_page + IO_SEQ_OFFSET);
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = IO_LOCK_WRITER, .l_len = 1 };
+    if (fcntl(image_fd, F_OFD_SETLK, &fl) == 0) {
+        __atomic_store_n(&seq->done, __atomic_load_n(&seq->begun, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    }
+    set_lock(IO_LOCK_WRITER, 1, F_RDLCK);
+}
+
+static void unmap_seq(void) {
+    if (seq_page != NULL && munmap(seq_page, sysconf(_SC_PAGESIZE)) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+    seq_page = NULL;
+    seq = NULL;
+}
+
+// Bump done for the operation in flight, if any. Also run at exit, so an
+// error exit does not leave readers waiting on it.
+static void write_end(void) {
+    if (writing) {
+        __atomic_fetch_add(&seq->done, 1, __ATOMIC_RELEASE);
+        writing = 0;
+    }
+}
+
+static void write_begin(void) {
+    if (!write_end_registered) {
+        atexit(write_end);
+        write_end_registered = 1;
+    }
+    __atomic_fetch_add(&seq->begun, 1, __ATOMIC_SEQ_CST);
+    writing = 1;
+}
+
+// Whether some process still has the image open for writing
+static int writer_alive(void) {
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = IO_LOCK_WRITER, .l_len = 1 };
+    if (fcntl(image_fd, F_OFD_GETLK, &fl) == -1) {
+        return 1;
+    }
+    return fl.l_type != F_UNLCK;
+}
+
+// read_begin waits until no writer is in the middle of an operation on the
+// image opened with open_image_readonly and returns its generation. A
+// writer that died mid-operation is not waited for.
+unsigned int read_begin(void) {
+    for (int tries = 0; ; tries++) {
+        // done first: if begun then matches it, no writer was in flight
+        // when begun was read
+        unsigned int done = __atomic_load_n(&seq->done, __ATOMIC_ACQUIRE);
+        unsigned int begun = __atomic_load_n(&seq->begun, __ATOMIC_ACQUIRE);
+        if (begun == done) {
+            return begun;
+        }
+        if (tries >= IO_READ_SPINS) {
+            if (!writer_alive()) {
+                return begun;
+            }
+            usleep(IO_READ_WAIT_US);
+        }
+    }
+}
+
+// read_retry tells whether a writer began since read_begin returned
+// generation. What was read since may then be torn; read it again.
+int read_retry(unsigned int generation) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&seq->begun, __ATOMIC_RELAXED) != generation;
+}
+
+/******************************************************************
+ * Image
+ ******************************************************************/
+// Point sb, gd, the bitmaps and the inode table into disk, and pick up
+// the image's checksum settings
+static void point_globals(void) {
+    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
+    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
+    block_bitmap = disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE;
+    inode_bitmap = disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE;
+    inode_table = (struct ext2_inode *)(disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    csum_init();
+}
+
+// The superblock and group descriptor give the size of the image and of
+// the metadata region.
+static void read_geometry(char *path) {
+    unsigned char head[3 * EXT2_BLOCK_SIZE];
+    read_blocks(head, 0, 3);
+    struct ext2_super_block *head_sb = (struct ext2_super_block *)(head + EXT2_BLOCK_SIZE);
+    struct ext2_group_desc *head_gd = (struct ext2_group_desc *)(head + 2 * EXT2_BLOCK_SIZE);
+    if (head_sb->s_magic != EXT2_SUPER_MAGIC) {
+        fprintf(stderr, "ERROR: %s is not an ext2 image\n", path);
+        exit(EINVAL);
+    }
+    image_size = (long long)head_sb->s_blocks_count * EXT2_BLOCK_SIZE;
+    int inode_table_blocks = (head_sb->s_inodes_count * sizeof(struct ext2_inode) + EXT2_BLOCK_SIZE - 1)
+                             / EXT2_BLOCK_SIZE;
+    meta_blocks = head_gd->bg_inode_table + inode_table_blocks;
+}
+
+// Point the globals at a held image
+static void select_held(struct held_image *held) {
+    backend = &mmap_backend;
+    image_fd = held->fd;
+    image_size = held->size;
+    meta_blocks = held->meta_blocks;
+    disk = held->disk;
+    seq_page = held->seq_page;
+    seq = (struct image_seq *)(seq_page + IO_SEQ_OFFSET);
+    shared = 1;
+    share_requested = 0;
+    current_held = held;
+    point_globals();
+}
+
+// hold_image opens an image, shared, and keeps it mapped until
+// release_held_images. open_image of the same path then only selects it
+// and close_image leaves it open, so a long-running process pays for the
+// open, the mapping and its page faults once. The mmap backend is needed.
+void hold_image(char *path) {
+    if (held_count == IO_MAX_HELD_IMAGES) {
+        fprintf(stderr, "ERROR: at most %d images can be held open\n", IO_MAX_HELD_IMAGES);
+        exit(1);
+    }
+    share_image();
+    open_image(path);
+    if (backend != &mmap_backend) {
+        fprintf(stderr, "ERROR: only the mmap backend can hold an image open\n");
+        exit(1);
+    }
+    struct held_image *held = &held_images[held_count++];
+    held->path = strdup(path);
+    held->fd = image_fd;
+    held->size = image_size;
+    held->meta_blocks = meta_blocks;
+    held->disk = disk;
+    held->seq_page = seq_page;
+    current_held = held;
+    // Holding the image changes nothing
+    write_end();
+}
+
+// release_held_images unmaps and closes every held image
+void release_held_images(void) {
+    for (int i = 0; i < held_count; i++) {
+        select_held(&held_images[i]);
+        drop_ranges();
+        backend->close();
+        unmap_seq();
+        close(image_fd);
+        free(held_images[i].path);
+    }
+    held_count = 0;
+    current_held = NULL;
+    image_fd = -1;
+    forget_locks();
+}
+
+// open_image opens the image with the backend named by EXT2_IO and
+// initializes the global variables (sb, gd, the bitmaps and the inode table).
+// Readers of the image see the tool as a writer until close_image.
+void open_image(char *path) {
+    stats_phase("open");
+    for (int i = 0; i < held_count; i++) {
+        if (strcmp(held_images[i].path, path) == 0) {
+            select_held(&held_images[i]);
+            write_begin();
+            stats_phase("lookup");
+            return;
+        }
+    }
+    current_held = NULL;
+    char *name = getenv("EXT2_IO");
+    if (name == NULL || strcmp(name, mmap_backend.name) == 0) {
+        backend = &mmap_backend;
+    } else if (strcmp(name, cache_backend.name) == 0) {
+        backend = &cache_backend;
+    } else if (strcmp(name, uring_backend.name) == 0) {
+        backend = &uring_backend;
+    } else {
+        fprintf(stderr, "ERROR: unknown I/O backend %s\n", name);
+        exit(1);
+    }
+
+    image_fd = open(path, O_RDWR);
+    if (image_fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    // Only the mmap backend changes the image in place, where other
+    // processes see it; the others write back at close.
+    shared = share_requested && backend == &mmap_backend;
+    share_requested = 0;
+    if (shared) {
+        set_lock(IO_LOCK_SESSION, 1, F_RDLCK);
+    } else {
+        set_lock(0, 0, F_WRLCK);
+    }
+
+    read_geometry(path);
+    backend->open(image_fd, image_size);
+    point_globals();
+    map_seq();
+    write_begin();
+    stats_phase("lookup");
+}
+
+// open_image_readonly maps the image PROT_READ for a reader that takes no
+// locks. Writers may change the image meanwhile, so every read goes
+// between read_begin and read_retry and starts over while read_retry says
+// so. The mmap backend is used whatever EXT2_IO says.
+void open_image_readonly(char *path) {
+    stats_phase("open");
+    current_held = NULL;
+    share_requested = 0;
+    backend = &mmap_backend;
+    read_only = 1;
+    image_fd = open(path, O_RDONLY);
+    if (image_fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    read_geometry(path);
+    backend->open(image_fd, image_size);
+    point_globals();
+    seq = (struct image_seq *)(disk + IO_SEQ_OFFSET);
+    stats_phase("lookup");
+}
+
+// flush_image writes every modified block back to the image.
+void flush_image(void) {
+    backend->flush();
+}
+
+// close_image flushes the image and releases the backend.
+void close_image(void) {
+    stats_phase("close");
+    backend->flush();
+    write_end();
+    if (current_held != NULL) {
+        drop_ranges();
+        return;
+    }
+    if (!read_only) {
+        unmap_seq();
+    }
+    if (close(image_fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    image_fd = -1;
+    backend->close();
+    forget_locks();
+    read_only = 0;
+    seq = NULL;
+}
+
+// release_image drops an image that is still open without flushing it, the
+// way an error exit would, so the next open_image starts over.
+void release_image(void) {
+    share_requested = 0;
+    write_end();
+    if (current_held != NULL) {
+        drop_ranges();
+        return;
+    }
+    if (image_fd == -1) {
+        return;
+    }
+    if (!read_only) {
+        unmap_seq();
+    }
+    close(image_fd);
+    image_fd = -1;
+    backend->close();
+    forget_locks();
+    read_only = 0;
+    seq = NULL;
+}
+
+// get_block returns the in-memory copy of a block. Call mark_dirty after
+// modifying it so the change reaches the image.
+unsigned char *get_block(int block_num) {
+    STAT_ADD(block_lookups, 1);
+    // A reader may follow a block number a writer is halfway through
+    // changing; it reads zeros instead of faulting, then retries.
+    if (read_only && (block_num <= 0 || block_num >= image_size / EXT2_BLOCK_SIZE)) {
+        return zero_block;
+    }
+    return backend->block(block_num);
+}
+
+// get_new_block returns a zeroed block that is about to be filled in, without
+// reading its old contents. It is already marked dirty.
+unsigned char *get_new_block(int block_num) {
+    return backend->new_block(block_num);
+}
+
+// prefetch_blocks starts reading blocks that are about to be used, so a
+// whole indirect fan-out or run of data blocks is read in one batch.
+void prefetch_blocks(int *blocks, int n) {
+    backend->prefetch(blocks, n);
+}
+
+void mark_dirty(int block_num) {
+    backend->dirty(block_num);
+}
+
+// io_thread_safe tells whether get_block may be called from several threads
+// at once. Only the mmap backend keeps no shared state per lookup.
+int io_thread_safe(void) {
+    return backend == &mmap_backend;
+}
@@ -0,0 +1,81 @@
+#ifndef CSC369_EXT2_FS_IO
+#define CSC369_EXT2_FS_IO
+
+// Number of data blocks the cache backends keep in memory, at least.
+// A pointer returned by get_block stays valid until this many other
+// blocks have been fetched.
+#define IO_CACHE_BLOCKS 64
+
+// Images up to this many bytes are prefaulted whole by the mmap backend
+#define IO_POPULATE_LIMIT (4 * 1024 * 1024)
+// Runs of at least this many blocks are prefetched as sequential
+#define IO_SEQUENTIAL_RUN 16
+
+// A shared image is held through a read lock on this byte, past the end
+// of any image; a tool that does not share it write locks the whole file.
+#define IO_LOCK_SESSION (1LL << 40)
+// Distinct ranges a tool may hold locked at once
+#define IO_MAX_HELD_RANGES 64
+// Images a process may hold open at once (hold_image)
+#define IO_MAX_HELD_IMAGES 16
+
+// Every tool that opens an image for writing holds a read lock on this
+// byte, so a reader can tell whether a writer is still alive.
+#define IO_LOCK_WRITER (IO_LOCK_SESSION + 1)
+// The writer generation counters (struct image_seq) live in the last bytes
+// of the boot block, which ext2 leaves unused with 1024-byte blocks.
+#define IO_SEQ_OFFSET 1016
+// A reader waiting for writers spins this many times before sleeping
+// IO_READ_WAIT_US between looks
+#define IO_READ_SPINS 100
+#define IO_READ_WAIT_US 100
+
+// A writer bumps begun before it changes the image and done once its
+// changes are all in the image, so no writer is in the middle of an
+// operation while the two are equal. Several writers may be in flight.
+struct image_seq {
+    unsigned int begun;
+    unsigned int done;
+};
+
+// An I/O backend serves the blocks of the image.
+// The metadata region (boot block through the end of the inode table) is
+// always resident at disk, so sb, gd, the bitmaps and the inode table can
+// be used as plain pointers with every backend.
+struct io_backend {
+    char *name;
+    void (*open)(int fd, long long size);
+    unsigned char *(*block)(int block_num);
+    unsigned char *(*new_block)(int block_num);
+    void (*prefetch)(int *blocks, int n);
+    void (*dirty)(int block_num);
+    void (*flush)(void);
+    void (*close)(void);
+};
+
+// Selected with the EXT2_IO environment variable, mmap by default.
+// EXT2_IO_HUGEPAGE=1 asks for transparent huge pages on the mmap backend.
+extern struct io_backend mmap_backend;
+extern struct io_backend cache_backend;
+extern struct io_backend uring_backend;
+
+void open_image(char *path);
+void close_image(void);
+void release_image(void);
+void flush_image(void);
+unsigned char *get_block(int block_num);
+unsigned char *get_new_block(int block_num);
+void prefetch_blocks(int *blocks, int n);
+void mark_dirty(int block_num);
+int io_thread_safe(void);
+void share_image(void);
+int image_shared(void);
+void lock_range(long long offset, long long len, int write);
+void unlock_range(long long offset, long long len);
+void hold_image(char *path);
+void release_held_images(void);
+void open_image_readonly(char *path);
+unsigned int read_begin(void);
+int read_retry(unsigned int generation);
+
+#endif
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+// Drop the image from the page cache so the next open starts cold.
+void drop_cache(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Open the image and read every block of every in-use inode, the way the
+// checker walks the image. It returns the elapsed time in microseconds.
+double scan_image(char *path, unsigned long *sum) {
+    struct timespec start, end;
+    int list[INODE_LIST_MAX];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    open_image(path);
+    for (int i = EXT2_ROOT_INO - 1; i < sb->s_inodes_count; i++) {
+        if (i + 1 != EXT2_ROOT_INO && (i < EXT2_GOOD_OLD_FIRST_INO - 1 || !is_set(inode_bitmap, i + 1))) {
+            continue;
+        }
+        int blocks = inode_block_list(i + 1, list);
+        prefetch_blocks(list, blocks);
+        for (int j = 0; j < blocks; j++) {
+            unsigned char *block = get_block(list[j]);
+            for (int k = 0; k < EXT2_BLOCK_SIZE; k += 64) {
+                *sum += block[k];
+            }
+        }
+    }
+    close_image();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+int main(int argc, char **argv) {
+    if(argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <image file name> [OPTIONAL iterations]\n", argv[0]);
+        exit(1);
+    }
+    int iterations = 10;
+    if (argc == 3) {
+        iterations = atoi(argv[2]);
+    }
+    if (iterations <= 0) {
+        fprintf(stderr, "ERROR: iterations must be positive\n");
+        exit(EINVAL);
+    }
+
+    /******************************************************************
+	 * Compare the backends on cold and warm images
+	 ******************************************************************/
+    char *backends[] = { mmap_backend.name, cache_backend.name, uring_backend.name };
+    unsigned long sum = 0;
+    for (int b = 0; b < 3; b++) {
+        setenv("EXT2_IO", backends[b], 1);
+        for (int cold = 1; cold >= 0; cold--) {
+            double total = 0;
+            double min = 0;
+            struct rusage before, after;
+            getrusage(RUSAGE_SELF, &before);
+            for (int i = 0; i < iterations; i++) {
+                if (cold) {
+                    drop_cache(argv[1]);
+                }
+                double elapsed = scan_image(argv[1], &sum);
+                total += elapsed;
+                if (i == 0 || elapsed < min) {
+                    min = elapsed;
+                }
+            }
+            getrusage(RUSAGE_SELF, &after);
+            printf("backend=%s image=%s iterations=%d mean_us=%.1f min_us=%.1f minor_faults=%ld major_faults=%ld\n",
+                   backends[b], cold ? "cold" : "warm", iterations, total / iterations, min,
+                   after.ru_minflt - before.ru_minflt, after.ru_majflt - before.ru_majflt);
+        }
+    }
+    // Keeps the reads from being optimized away
+    fprintf(stderr, "checksum %lu\n", sum);
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return 0;
+}
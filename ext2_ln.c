@@ -11,32 +11,19 @@
 #include <sys/stat.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
 
 int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    trace_op(argc, argv);
     if(argc < 4) {
         fprintf(stderr, 
         "Usage: %s <image file name> [OPTIONAL -s] <absolute path to src file> <absolute path to dest file>\n",
          argv[0]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        exit(1);
-    }
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    // Initalize the global variables
-    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
-    block_bitmap = disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE;
-    inode_bitmap = disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE;
-    inode_table = (struct ext2_inode *)(disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    share_image();
+    open_image(argv[1]);
 
     if (argc == 4) {  // hard link
         char *source = argv[2];
@@ -65,10 +52,28 @@ int main(int argc, char **argv) {
         /******************************************************************
 	     * Link
 	     ******************************************************************/
+        stats_phase("link");
+
+        // Other processes may change either directory meanwhile: look
+        // again under the locks, and count the link before it shows.
+        dir_write_lock(t_prev_inode);
+        if (check_exist(target_filename, t_prev_inode)) {
+            fprintf(stderr, "ERROR: link name %s already exists.\n", target_filename);
+            exit(EISDIR);
+        }
+        links_lock(s_inode);
+        if (inode_table[s_inode - 1].i_links_count == 0) {
+            links_unlock(s_inode);
+            fprintf(stderr, "ERROR: source file %s does not exist.\n", source_filename);
+            exit(ENOENT);
+        }
+        inode_table[s_inode - 1].i_links_count++;
+        update_inode_csum(s_inode);
+        links_unlock(s_inode);
 
         // Create a link under the target parent inode dir enty
         insert_dir_entry(s_inode, target_filename, t_prev_inode, EXT2_FT_REG_FILE);
-        inode_table[s_inode - 1].i_links_count++;
+        dir_unlock(t_prev_inode);
         /******************************************************************
 	     * End
 	     ******************************************************************/
@@ -102,7 +107,13 @@ int main(int argc, char **argv) {
         /******************************************************************
 	    * Link
 	     ******************************************************************/
+        stats_phase("link");
 
+        dir_write_lock(t_prev_inode);
+        if (check_exist(target_filename, t_prev_inode)) {
+            fprintf(stderr, "ERROR: link name %s already exists.\n", target_filename);
+            exit(EEXIST);
+        }
         // Get new inode and block num for the soft link
         int new_inode_num = find_next_available(inode_bitmap, INODE_BITMAP_SIZE);
         int new_block_num = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
@@ -127,26 +138,19 @@ int main(int argc, char **argv) {
         inode_table[new_inode_num - 1].i_file_acl = 0;
         inode_table[new_inode_num - 1].i_dir_acl = 0;
         inode_table[new_inode_num - 1].i_faddr = 0;
-        
+        update_inode_csum(new_inode_num);
+
         // Copy the source path name to the soft link's data block
-        struct ext2_dir_entry *data = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * new_block_num);
+        struct ext2_dir_entry *data = (struct ext2_dir_entry *)get_new_block(new_block_num);
         memcpy(data, source, file_size);
+        dir_unlock(t_prev_inode);
 
         /******************************************************************
 	     * End
 	     ******************************************************************/
     }
 
-    if (close(fd) == -1) {
-        perror("close");
-        exit(1);
-    }
-
-    int ret = munmap(disk, 128 * 1024);
-    if (ret == -1) {
-        perror("munmap");
-        exit(1);
-    }
+    close_image();
 
     return 0;
 }
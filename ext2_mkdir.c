@@ -11,31 +11,18 @@
 
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
 
 int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    trace_op(argc, argv);
     
     if(argc <= 2) {
         fprintf(stderr, "Usage: %s <image file name> <absolute path to directory>\n", argv[0]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        exit(1);
-    }
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    // Initalize the global variables
-    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
-    block_bitmap = disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE;
-    inode_bitmap = disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE;
-    inode_table = (struct ext2_inode *)(disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    share_image();
+    open_image(argv[1]);
 
     // Path validation
     char *path = argv[2];
@@ -56,11 +43,22 @@ int main(int argc, char **argv) {
     /******************************************************************
 	 * Create inode, block, dir_entry
 	******************************************************************/
+    stats_phase("create");
+    // Other processes may add to the parent too. Hold it from a last
+    // look for the name until the new directory is in it.
+    dir_write_lock(prev_inode);
+    if (check_exist(dirname, prev_inode)) {
+        fprintf(stderr, "ERROR: file or directory %s already exists.\n", dirname);
+        exit(EEXIST);
+    }
     // Allocate a new block and inode num to the new directory
     int new_inode_num = find_next_available(inode_bitmap, INODE_BITMAP_SIZE);
     int new_block_num = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
 
+    links_lock(prev_inode);
     inode_table[prev_inode - 1].i_links_count++;
+    update_inode_csum(prev_inode);
+    links_unlock(prev_inode);
     inode_table[new_inode_num - 1].i_mode = 0;
     inode_table[new_inode_num - 1].i_mode |= EXT2_S_IFDIR;
     inode_table[new_inode_num - 1].i_uid = 0;
@@ -76,12 +74,13 @@ int main(int argc, char **argv) {
     inode_table[new_inode_num - 1].i_file_acl = 0;
     inode_table[new_inode_num - 1].i_dir_acl = 0;
     inode_table[new_inode_num - 1].i_faddr = 0;
+    update_inode_csum(new_inode_num);
 
     // Insert it in the parent inode (prev_inode) and set the type to EXT2_FT_DIR
     insert_dir_entry(new_inode_num, dirname, prev_inode, EXT2_FT_DIR);
 
     // Create an "empty" directory enty for this direcotry 
-    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * new_block_num);
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)get_new_block(new_block_num);
     entry->inode = new_inode_num;
     entry->rec_len = 12;
     entry->name_len = 1;
@@ -90,25 +89,19 @@ int main(int argc, char **argv) {
     memcpy(entry->name, ".", 1);
     struct ext2_dir_entry *next = (struct ext2_dir_entry *)((char *)entry + entry->rec_len);
     next->inode = prev_inode;
-    next->rec_len = EXT2_BLOCK_SIZE - entry->rec_len;
+    next->rec_len = DIR_BLOCK_END - entry->rec_len;
     next->name_len = 2;
     next->file_type = 0;
     next->file_type |= EXT2_FT_DIR;
     memcpy(next->name, "..", 2);
+    init_dir_tail((unsigned char *)entry);
+    update_dir_csum(new_inode_num, new_block_num);
 
     // Increment used dir count
-    gd->bg_used_dirs_count++;
+    add_used_dirs(1);
+    dir_unlock(prev_inode);
 
-    if (close(fd) == -1) {
-        perror("close");
-        exit(1);
-    }
-
-    int ret = munmap(disk, 128 * 1024);
-    if (ret == -1) {
-        perror("munmap");
-        exit(1);
-    }
+    close_image();
     /******************************************************************
 	 * End
 	 ******************************************************************/
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+
+// Defaults match the images the assignment tools expect:
+// 128 blocks of 1024 bytes and 32 inodes.
+#define DEFAULT_BLOCKS_COUNT 128
+#define DEFAULT_INODE_RATIO 4096
+// Everything lives in a single block group, so one bitmap block bounds
+// both the number of blocks and the number of inodes.
+#define MAX_GROUP_COUNT (EXT2_BLOCK_SIZE * 8)
+#define LOST_FOUND_INO 11
+#define LOST_FOUND_BLOCKS 12
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONAL -b block size] [OPTIONAL -i bytes per inode] [OPTIONAL -z] [OPTIONAL -c] "
+            "<image file name> [OPTIONAL blocks count]\n", prog);
+    exit(1);
+}
+
+// Fill a dir block with "." and "..", the last entry taking up the rest
+// of the block up to its checksum tail, if any.
+void init_dir_block(unsigned char *block, int inode, int parent_inode) {
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)block;
+    entry->inode = inode;
+    entry->rec_len = actual_rec_len(1);
+    entry->name_len = 1;
+    entry->file_type = EXT2_FT_DIR;
+    memcpy(entry->name, ".", 1);
+    struct ext2_dir_entry *next = (struct ext2_dir_entry *)(block + entry->rec_len);
+    next->inode = parent_inode;
+    next->rec_len = DIR_BLOCK_END - entry->rec_len;
+    next->name_len = 2;
+    next->file_type = EXT2_FT_DIR;
+    memcpy(next->name, "..", 2);
+    init_dir_tail(block);
+}
+
+// Sum the dir blocks first .. first + count - 1 of inode
+void sum_dir_blocks(int inode, int first, int count) {
+    for (int i = 0; i < count; i++) {
+        unsigned char *block = disk + (first + i) * EXT2_BLOCK_SIZE;
+        dir_tail(block)->det_checksum = dir_csum(inode, block);
+    }
+}
+
+// Fill in a directory inode that owns the blocks first .. first + count - 1
+void init_dir_inode(struct ext2_inode *inode, unsigned short mode, int first, int count, int links) {
+    unsigned int now = time(NULL);
+    memset(inode, 0, sizeof(struct ext2_inode));
+    inode->i_mode = EXT2_S_IFDIR | mode;
+    inode->i_size = count * EXT2_BLOCK_SIZE;
+    inode->i_atime = now;
+    inode->i_ctime = now;
+    inode->i_mtime = now;
+    inode->i_links_count = links;
+    inode->i_blocks = count * (EXT2_BLOCK_SIZE / 512);
+    for (int i = 0; i < count; i++) {
+        inode->i_block[i] = first + i;
+    }
+}
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    int block_size = EXT2_BLOCK_SIZE;
+    int inode_ratio = DEFAULT_INODE_RATIO;
+    int zero_inode_table = 0;
+    int metadata_csum = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:i:zc")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = atoi(optarg);
+            break;
+        case 'i':
+            inode_ratio = atoi(optarg);
+            break;
+        case 'z':
+            zero_inode_table = 1;
+            break;
+        case 'c':
+            metadata_csum = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(argv[0]);
+    }
+    int blocks_count = DEFAULT_BLOCKS_COUNT;
+    if (optind == argc - 2) {
+        blocks_count = atoi(argv[optind + 1]);
+    }
+
+    /******************************************************************
+	 * Geometry
+	 ******************************************************************/
+    stats_phase("geometry");
+    // Every tool addresses blocks as EXT2_BLOCK_SIZE units.
+    if (block_size != EXT2_BLOCK_SIZE) {
+        fprintf(stderr, "ERROR: block size %d is not supported, only %d\n", block_size, EXT2_BLOCK_SIZE);
+        exit(EINVAL);
+    }
+    if (inode_ratio < EXT2_BLOCK_SIZE) {
+        fprintf(stderr, "ERROR: bytes per inode must be at least %d\n", EXT2_BLOCK_SIZE);
+        exit(EINVAL);
+    }
+
+    // Round the inode count to whole inode table blocks.
+    int inodes_per_block = EXT2_BLOCK_SIZE / EXT2_GOOD_OLD_INODE_SIZE;
+    long long bytes = (long long)blocks_count * EXT2_BLOCK_SIZE;
+    int inodes_count = bytes / inode_ratio;
+    inodes_count = (inodes_count + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    if (inodes_count < 2 * inodes_per_block) {
+        inodes_count = 2 * inodes_per_block;
+    }
+    if (inodes_count > MAX_GROUP_COUNT) {
+        inodes_count = MAX_GROUP_COUNT;
+    }
+    int inode_table_blocks = inodes_count / inodes_per_block;
+
+    // Block 0 is the boot block, followed by the superblock, the group
+    // descriptor, both bitmaps and the inode table. Root takes the next
+    // block and lost+found the LOST_FOUND_BLOCKS after it.
+    int block_bitmap_num = 3;
+    int inode_bitmap_num = 4;
+    int inode_table_num = 5;
+    int root_block_num = inode_table_num + inode_table_blocks;
+    int lost_found_num = root_block_num + 1;
+    int used_blocks = lost_found_num + LOST_FOUND_BLOCKS;
+
+    if (blocks_count <= used_blocks || blocks_count > MAX_GROUP_COUNT + 1) {
+        fprintf(stderr, "ERROR: blocks count must be between %d and %d\n", used_blocks + 1, MAX_GROUP_COUNT + 1);
+        exit(EINVAL);
+    }
+
+    /******************************************************************
+	 * Create the image
+	 ******************************************************************/
+    stats_phase("create");
+    int fd = open(argv[optind], O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+
+    // A regular file is recreated sparse, so its inode table already reads
+    // back as zeros without writing it. A block device keeps whatever was on
+    // it, so unless -z is given the table is left for the tools to zero one
+    // inode at a time as they allocate them.
+    int table_zeroed = zero_inode_table;
+    if (S_ISREG(st.st_mode)) {
+        if (ftruncate(fd, 0) == -1 || ftruncate(fd, bytes) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
+        table_zeroed = 1;
+    } else {
+        // st_size is 0 for a block device, so ask the device for its size
+        unsigned long long size = st.st_size;
+        if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == -1) {
+            perror("ioctl");
+            exit(1);
+        }
+        if ((size != 0 || S_ISBLK(st.st_mode)) && size < bytes) {
+            fprintf(stderr, "ERROR: %s is smaller than %lld bytes\n", argv[optind], bytes);
+            exit(ENOSPC);
+        }
+    }
+
+    disk = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    // Clear everything up to the first free block except the inode table,
+    // which only gets its reserved inodes written.
+    memset(disk, 0, inode_table_num * EXT2_BLOCK_SIZE);
+    memset(disk + root_block_num * EXT2_BLOCK_SIZE, 0, (1 + LOST_FOUND_BLOCKS) * EXT2_BLOCK_SIZE);
+    if (zero_inode_table && !S_ISREG(st.st_mode)) {
+        memset(disk + inode_table_num * EXT2_BLOCK_SIZE, 0, inode_table_blocks * EXT2_BLOCK_SIZE);
+    } else {
+        memset(disk + inode_table_num * EXT2_BLOCK_SIZE, 0, LOST_FOUND_INO * EXT2_GOOD_OLD_INODE_SIZE);
+    }
+
+    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
+    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
+    block_bitmap = disk + block_bitmap_num * EXT2_BLOCK_SIZE;
+    inode_bitmap = disk + inode_bitmap_num * EXT2_BLOCK_SIZE;
+    inode_table = (struct ext2_inode *)(disk + inode_table_num * EXT2_BLOCK_SIZE);
+
+    /******************************************************************
+	 * Superblock and group descriptor
+	 ******************************************************************/
+    stats_phase("superblock");
+    unsigned int now = time(NULL);
+    // The group covers blocks 1 .. blocks_count - 1
+    int group_blocks = blocks_count - 1;
+    sb->s_inodes_count = inodes_count;
+    sb->s_blocks_count = blocks_count;
+    sb->s_r_blocks_count = blocks_count / 20;
+    sb->s_free_blocks_count = group_blocks - used_blocks + 1;
+    sb->s_free_inodes_count = inodes_count - LOST_FOUND_INO;
+    sb->s_first_data_block = 1;
+    sb->s_log_block_size = 0;
+    sb->s_log_frag_size = 0;
+    sb->s_blocks_per_group = MAX_GROUP_COUNT;
+    sb->s_frags_per_group = MAX_GROUP_COUNT;
+    sb->s_inodes_per_group = inodes_count;
+    sb->s_wtime = now;
+    sb->s_max_mnt_count = 0xFFFF;
+    sb->s_magic = EXT2_SUPER_MAGIC;
+    sb->s_state = 1;
+    sb->s_errors = 1;
+    sb->s_lastcheck = now;
+    sb->s_rev_level = 1;
+    sb->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    sb->s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+    sb->s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    sb->s_def_hash_version = 1;
+
+    FILE *random = fopen("/dev/urandom", "r");
+    if (random == NULL || fread(sb->s_uuid, sizeof(sb->s_uuid), 1, random) != 1 ||
+        fread(sb->s_hash_seed, sizeof(sb->s_hash_seed), 1, random) != 1) {
+        srand(now);
+        for (int i = 0; i < sizeof(sb->s_uuid); i++) {
+            sb->s_uuid[i] = rand();
+        }
+        for (int i = 0; i < 4; i++) {
+            sb->s_hash_seed[i] = rand();
+        }
+    }
+    if (random != NULL) {
+        fclose(random);
+    }
+    // -c turns on metadata checksums, seeded from the uuid just picked
+    if (metadata_csum) {
+        sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_METADATA_CSUM;
+        sb->s_checksum_type = EXT2_CRC32C_CHKSUM;
+    }
+    csum_init();
+
+    gd->bg_block_bitmap = block_bitmap_num;
+    gd->bg_inode_bitmap = inode_bitmap_num;
+    gd->bg_inode_table = inode_table_num;
+    gd->bg_free_blocks_count = sb->s_free_blocks_count;
+    gd->bg_free_inodes_count = sb->s_free_inodes_count;
+    gd->bg_used_dirs_count = 2;
+    if (table_zeroed) {
+        gd->bg_flags = EXT2_BG_INODE_ZEROED;
+    } else {
+        gd->bg_flags = EXT2_BG_INODE_LAZY;
+    }
+    if (metadata_csum) {
+        gd->bg_itable_unused = inodes_count - LOST_FOUND_INO;
+    }
+
+    /******************************************************************
+	 * Bitmaps
+	 ******************************************************************/
+    stats_phase("bitmaps");
+    // Bits past the end of the group are padding and always set.
+    // set_bit is not used here since the free counts above are final.
+    for (int i = 0; i < EXT2_BLOCK_SIZE * 8; i++) {
+        if (i < used_blocks - 1 || i >= group_blocks) {
+            block_bitmap[i / 8] |= 1 << (i % 8);
+        }
+        if (i < LOST_FOUND_INO || i >= inodes_count) {
+            inode_bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    /******************************************************************
+	 * Root and lost+found
+	 ******************************************************************/
+    stats_phase("root");
+    init_dir_inode(&inode_table[EXT2_ROOT_INO - 1], 0755, root_block_num, 1, 3);
+    init_dir_inode(&inode_table[LOST_FOUND_INO - 1], 0700, lost_found_num, LOST_FOUND_BLOCKS, 2);
+
+    unsigned char *root_block = disk + root_block_num * EXT2_BLOCK_SIZE;
+    init_dir_block(root_block, EXT2_ROOT_INO, EXT2_ROOT_INO);
+    struct ext2_dir_entry *dotdot = (struct ext2_dir_entry *)(root_block + actual_rec_len(1));
+    dotdot->rec_len = actual_rec_len(2);
+    struct ext2_dir_entry *lost_found = (struct ext2_dir_entry *)((char *)dotdot + dotdot->rec_len);
+    lost_found->inode = LOST_FOUND_INO;
+    lost_found->rec_len = DIR_BLOCK_END - actual_rec_len(1) - actual_rec_len(2);
+    lost_found->name_len = strlen("lost+found");
+    lost_found->file_type = EXT2_FT_DIR;
+    memcpy(lost_found->name, "lost+found", lost_found->name_len);
+
+    // lost+found is preallocated so that a checker never has to allocate
+    // blocks to reconnect inodes. Its extra blocks hold one empty entry each.
+    init_dir_block(disk + lost_found_num * EXT2_BLOCK_SIZE, LOST_FOUND_INO, EXT2_ROOT_INO);
+    for (int i = 1; i < LOST_FOUND_BLOCKS; i++) {
+        struct ext2_dir_entry *empty = (struct ext2_dir_entry *)(disk + (lost_found_num + i) * EXT2_BLOCK_SIZE);
+        empty->rec_len = DIR_BLOCK_END;
+        init_dir_tail((unsigned char *)empty);
+    }
+
+    /******************************************************************
+	 * Checksums
+	 ******************************************************************/
+    stats_phase("checksums");
+    if (metadata_csum) {
+        sum_dir_blocks(EXT2_ROOT_INO, root_block_num, 1);
+        sum_dir_blocks(LOST_FOUND_INO, lost_found_num, LOST_FOUND_BLOCKS);
+        for (int i = 1; i <= LOST_FOUND_INO; i++) {
+            inode_table[i - 1].i_checksum_lo = inode_csum(i);
+        }
+        gd->bg_block_bitmap_csum_lo = bitmap_csum(block_bitmap);
+        gd->bg_inode_bitmap_csum_lo = bitmap_csum(inode_bitmap);
+        update_group_csum();
+    }
+
+    if (munmap(disk, bytes) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return 0;
+}
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <ftw.h>
+#include <time.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+// The tools are compiled into the driver with their main renamed, so every
+// traced operation runs in-process exactly the way the tool runs it.
+#define main ext2_mkdir_main
+#include "ext2_mkdir.c"
+#undef main
+#define main ext2_cp_main
+#include "ext2_cp.c"
+#undef main
+#define main ext2_ln_main
+#include "ext2_ln.c"
+#undef main
+#define main ext2_rm_main
+#include "ext2_rm.c"
+#undef main
+#define main ext2_restore_main
+#include "ext2_restore.c"
+#undef main
+#define main ext2_checker_main
+#include "ext2_checker.c"
+#undef main
+#define main ext2_rm_bonus_main
+#include "ext2_rm_bonus.c"
+#undef main
+#define main ext2_restore_bonus_main
+#include "ext2_restore_bonus.c"
+#undef main
+
+// A trace line has at most this many tool arguments after the image, since
+// each takes a tab and at least one character
+#define MAX_ARGS (TRACE_LINE_MAX / 2)
+
+struct replay_op {
+    char *name;
+    int (*run)(int argc, char **argv);
+    double *samples;    // latency of every replayed op, in microseconds
+    int count;
+    int capacity;
+    int errors;         // ops the tool failed with a non-zero status
+};
+
+struct replay_op ops[] = {
+    { "mkdir", ext2_mkdir_main }, { "cp", ext2_cp_main }, { "ln", ext2_ln_main },
+    { "rm", ext2_rm_main }, { "restore", ext2_restore_main }, { "checker", ext2_checker_main },
+    { "rm_bonus", ext2_rm_bonus_main }, { "restore_bonus", ext2_restore_bonus_main },
+};
+#define OP_COUNT (sizeof(ops) / sizeof(ops[0]))
+
+// Native source files for the traced ext2_cp calls
+char src_dir[PATH_MAX / 2];
+
+// The driver is linked with -Wl,--wrap=exit: an error exit inside a tool
+// lands here and unwinds back to run_op instead of ending the replay.
+static jmp_buf op_env;
+static int op_running;
+
+void __real_exit(int status) __attribute__((noreturn));
+
+void __wrap_exit(int status) {
+    if (op_running) {
+        op_running = 0;
+        longjmp(op_env, status + 1);
+    }
+    __real_exit(status);
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONAL -t time compression factor] [OPTIONAL -k] [OPTIONAL -v] "
+            "<image file name> <trace file name>\n", prog);
+    exit(1);
+}
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void copy_image(char *from, char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in == -1 || out == -1) {
+        perror("open");
+        exit(1);
+    }
+    char buf[64 * EXT2_BLOCK_SIZE];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(in);
+    close(out);
+}
+
+// src_file returns a native file of size bytes with the basename of the
+// traced source, since ext2_cp names the copy after it. Files are created
+// on first use under src_dir/<size>/.
+char *src_file(char *traced, long long size) {
+    static char path[PATH_MAX];
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s", traced);
+    snprintf(path, sizeof(path), "%s/%lld", src_dir, size);
+    mkdir(path, 0755);
+    int len = strlen(path);
+    snprintf(path + len, sizeof(path) - len, "/%s", basename(name));
+    if (access(path, F_OK) == 0) {
+        return path;
+    }
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    for (long long i = 0; i < size; i++) {
+        fputc(i & 0xff, fp);
+    }
+    fclose(fp);
+    return path;
+}
+
+// Run one tool in-process. It returns the tool's exit status.
+int run_op(struct replay_op *op, int argc, char **argv) {
+    volatile int status;
+    int jumped = setjmp(op_env);
+    if (jumped == 0) {
+        op_running = 1;
+        status = op->run(argc, argv);
+        op_running = 0;
+    } else {
+        // The tool bailed out with the image still open
+        status = jumped - 1;
+        release_image();
+    }
+    return status;
+}
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+void add_sample(struct replay_op *op, double elapsed) {
+    if (op->count == op->capacity) {
+        op->capacity = op->capacity ? op->capacity * 2 : 64;
+        op->samples = realloc(op->samples, op->capacity * sizeof(double));
+        if (op->samples == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    op->samples[op->count++] = elapsed;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(double *)a;
+    double y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+// Print one result line: throughput and latency percentiles of an op type.
+void report(struct replay_op *op) {
+    double total = 0;
+    for (int i = 0; i < op->count; i++) {
+        total += op->samples[i];
+    }
+    qsort(op->samples, op->count, sizeof(double), compare_double);
+    int p99 = op->count * 99 / 100;
+    if (p99 >= op->count) {
+        p99 = op->count - 1;
+    }
+    printf("op=%s count=%d errors=%d ops_per_sec=%.1f mean_us=%.3f p50_us=%.3f p99_us=%.3f\n",
+           op->name, op->count, op->errors, total > 0 ? op->count / (total / 1e6) : 0,
+           total / op->count, op->samples[op->count / 2], op->samples[p99]);
+}
+
+int main(int argc, char **argv) {
+    double factor = 0;
+    int keep = 0;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:kv")) != -1) {
+        switch (opt) {
+        case 't':
+            factor = atof(optarg);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2) {
+        usage(argv[0]);
+    }
+    if (factor < 0) {
+        fprintf(stderr, "ERROR: time compression factor must not be negative\n");
+        exit(EINVAL);
+    }
+    FILE *trace = fopen(argv[optind + 1], "r");
+    if (trace == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+
+    /******************************************************************
+	 * Set up the copy of the image
+	 ******************************************************************/
+    char work[PATH_MAX];
+    snprintf(work, sizeof(work), "%s.replay", argv[optind]);
+    copy_image(argv[optind], work);
+    strcpy(src_dir, "/tmp/ext2_replay.XXXXXX");
+    if (mkdtemp(src_dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    // Replayed ops must not be traced again
+    unsetenv("EXT2_TRACE");
+
+    // The tools report errors and fixes on stdout/stderr; keep them out of
+    // the results unless asked for.
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = dup(STDERR_FILENO);
+    if (!verbose) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+
+    /******************************************************************
+	 * Replay
+	 ******************************************************************/
+    char line[TRACE_LINE_MAX];
+    long long first_time = -1;
+    int skipped = 0;
+    int replayed = 0;
+    double start = now_us();
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        // time, tool, size, then the tool's arguments after the image
+        char *fields[MAX_ARGS + 3];
+        int n = 0;
+        char *field = strtok(line, "\t");
+        while (field != NULL && n < MAX_ARGS + 3) {
+            fields[n++] = field;
+            field = strtok(NULL, "\t");
+        }
+        struct replay_op *op = NULL;
+        for (int i = 0; n >= 3 && i < OP_COUNT; i++) {
+            if (strcmp(fields[1], ops[i].name) == 0) {
+                op = &ops[i];
+            }
+        }
+        if (op == NULL) {
+            skipped++;
+            continue;
+        }
+
+        // Keep the recorded spacing, compressed by factor
+        long long time = atoll(fields[0]);
+        if (first_time == -1) {
+            first_time = time;
+        }
+        if (factor > 0) {
+            double wait = start + (time - first_time) / factor - now_us();
+            if (wait > 0) {
+                usleep(wait);
+            }
+        }
+
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "ext2_%s", op->name);
+        char *op_argv[MAX_ARGS + 3];
+        int op_argc = 0;
+        op_argv[op_argc++] = name;
+        op_argv[op_argc++] = work;
+        for (int i = 3; i < n; i++) {
+            op_argv[op_argc++] = fields[i];
+        }
+        op_argv[op_argc] = NULL;
+        // Every argument before the destination is a source, and the size
+        // field holds their sizes in the same order
+        int sources = 0;
+        if (op->run == ext2_cp_main) {
+            char *size = fields[2];
+            for (int i = 2; i < op_argc - 1; i++) {
+                op_argv[i] = strdup(src_file(op_argv[i], strtoll(size, &size, 10)));
+                if (op_argv[i] == NULL) {
+                    perror("strdup");
+                    exit(1);
+                }
+                size += *size == ',';
+                sources++;
+            }
+        }
+
+        double op_start = now_us();
+        if (run_op(op, op_argc, op_argv) != 0) {
+            op->errors++;
+        }
+        add_sample(op, now_us() - op_start);
+        for (int i = 2; i < 2 + sources; i++) {
+            free(op_argv[i]);
+        }
+        replayed++;
+    }
+    double elapsed = now_us() - start;
+    fclose(trace);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+
+    /******************************************************************
+	 * Report
+	 ******************************************************************/
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (ops[i].count > 0) {
+            report(&ops[i]);
+        }
+        free(ops[i].samples);
+    }
+    printf("op=all count=%d skipped=%d elapsed_s=%.3f ops_per_sec=%.1f\n", replayed, skipped,
+           elapsed / 1e6, elapsed > 0 ? replayed / (elapsed / 1e6) : 0);
+
+    nftw(src_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if (!keep) {
+        unlink(work);
+    }
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return 0;
+}
@@ -12,35 +12,100 @@
 #include <time.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
 
 int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    trace_op(argc, argv);
     if(argc != 3) {
-        fprintf(stderr, "Usage: %s <image file name> <absolute path to file/link>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <image file name> <absolute path to file/link | --all>\n", argv[0]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        exit(1);
+    // Restoring every removed file scans all directories, so it keeps
+    // the image to itself.
+    if (strcmp(argv[2], "--all") != 0) {
+        share_image();
     }
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
-    block_bitmap = disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE;
-    inode_bitmap = disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE;
-    inode_table = (struct ext2_inode *)(disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    open_image(argv[1]);
 
     if (gd->bg_free_blocks_count == 0 || gd->bg_free_inodes_count == 0) {
         fprintf(stderr, "ERROR: Not enough space in the file system\n");
         exit(ENOSPC);
     }
 
+    /******************************************************************
+	 * Restore every removed file
+	 ******************************************************************/
+    if (strcmp(argv[2], "--all") == 0) {
+        stats_phase("restore");
+        struct hidden_entry *entries;
+        int found = find_hidden_entries(&entries);
+
+        // Blocks taken by the image or by a file restored earlier in this
+        // pass. One check against it covers every candidate.
+        unsigned char *claimed = malloc(BLOCK_BITMAP_SIZE);
+        int *restored_inode = calloc(sb->s_inodes_count + 1, sizeof(int));
+        if (claimed == NULL || restored_inode == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(claimed, block_bitmap, BLOCK_BITMAP_SIZE);
+
+        int restored = 0;
+        int list[INODE_LIST_MAX];
+        for (int i = 0; i < found; i++) {
+            struct hidden_entry *entry = &entries[i];
+            int target = entry->inode;
+            if (IS_S_DIR(target)) {
+                fprintf(stderr, "Skipped: %s: Is a directory\n", entry->name);
+                continue;
+            }
+            if (check_exist(entry->name, entry->dir)) {
+                fprintf(stderr, "Skipped: %s: a file of that name exists\n", entry->name);
+                continue;
+            }
+            // A second name of a file restored in this pass is a hard link
+            if (restored_inode[target]) {
+                unhide_entry(entry);
+                inode_table[target - 1].i_links_count++;
+                update_inode_csum(target);
+                restored++;
+                continue;
+            }
+            if (target < EXT2_GOOD_OLD_FIRST_INO || is_set(inode_bitmap, target)) {
+                fprintf(stderr, "Skipped: %s: inode %d is in use\n", entry->name, target);
+                continue;
+            }
+            int n = inode_block_list(target, list);
+            if (n < 0) {
+                fprintf(stderr, "Skipped: %s: inode %d is corrupt\n", entry->name, target);
+                continue;
+            }
+            int conflict = 0;
+            for (int j = 0; j < n && !conflict; j++) {
+                conflict = list[j] <= 0 || list[j] >= sb->s_blocks_count || is_set(claimed, list[j]);
+            }
+            if (conflict) {
+                fprintf(stderr, "Skipped: %s: its blocks have been reused\n", entry->name);
+                continue;
+            }
+            for (int j = 0; j < n; j++) {
+                claimed[(list[j] - 1) / 8] |= 1 << ((list[j] - 1) % 8);
+            }
+            unhide_entry(entry);
+            restore_dir_entry(target, entry->name, entry->dir);
+            restored_inode[target] = 1;
+            restored++;
+        }
+        printf("Restored %d of %d removed entries\n", restored, found);
+        free(entries);
+        free(claimed);
+        free(restored_inode);
+
+        close_image();
+        return 0;
+    }
+
     char *path = argv[2];
     validate_path(path, ABS_PATH);
     char* name = basename(path);
@@ -54,7 +119,9 @@ int main(int argc, char **argv) {
     /******************************************************************
 	 * Restore
 	 ******************************************************************/
+    stats_phase("restore");
     // See if the file is recoverable
+    dir_write_lock(prev_inode);
     inode = check_restore(name, prev_inode);
     if (!inode) {
         fprintf(stderr, "ERROR: cannot restore file %s\n", name);
@@ -64,17 +131,10 @@ int main(int argc, char **argv) {
         exit(ENOENT);
     }
     restore_dir_entry(inode, name, prev_inode);
+    unhide_restored(name, prev_inode);
+    dir_unlock(prev_inode);
 
-    if (close(fd) == -1) {
-        perror("close");
-        exit(1);
-    }
-
-    int ret = munmap(disk, 128 * 1024);
-    if (ret == -1) {
-        perror("munmap");
-        exit(1);
-    }
+    close_image();
     /******************************************************************
 	 * End
 	 ******************************************************************/
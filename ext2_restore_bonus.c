@@ -12,29 +12,16 @@
 #include <time.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
 
 int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    trace_op(argc, argv);
     if(argc < 3) {
         fprintf(stderr, "Usage: %s <image file name> [OPTIONAL -r] <absolute path to file>\n", argv[0]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        exit(1);
-    }
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
-    block_bitmap = disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE;
-    inode_bitmap = disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE;
-    inode_table = (struct ext2_inode *)(disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    open_image(argv[1]);
 
     if (gd->bg_free_blocks_count == 0 || gd->bg_free_inodes_count == 0) {
         fprintf(stderr, "ERROR: Not enough space in the file system\n");
@@ -43,6 +30,7 @@ int main(int argc, char **argv) {
     /******************************************************************
 	 * Restore
 	 ******************************************************************/
+    stats_phase("restore");
     if ( argc == 3 ) {
         char *path = argv[2];
         validate_path(path, 1);
@@ -63,6 +51,7 @@ int main(int argc, char **argv) {
             exit(ENOENT);
         }
         restore_dir_entry(inode, name, prev_inode);
+        unhide_restored(name, prev_inode);
     } else if ( argc == 4 ) {
         if ( strcmp(argv[2], "-r") != 0 ) {
             fprintf(stderr, "Usage: %s <image file name> [OPTIONAL -r] <absolute path to file>\n", argv[0]);
@@ -93,19 +82,11 @@ int main(int argc, char **argv) {
         } else {
             restore_dir(inode, name, prev_inode);
         }
+        unhide_restored(name, prev_inode);
 
     }
 
-    if (close(fd) == -1) {
-        perror("close");
-        exit(1);
-    }
-    
-    int ret = munmap(disk, 128 * 1024);
-    if (ret == -1) {
-        perror("munmap");
-        exit(1);
-    }
+    close_image();
     /******************************************************************
 	 * End
 	 ******************************************************************/
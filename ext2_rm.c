@@ -12,30 +12,17 @@
 #include <time.h>
 #include "ext2.h"
 #include "ext2_helper.h"
+#include "ext2_io.h"
 
 int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    trace_op(argc, argv);
     if(argc != 3) {
         fprintf(stderr, "Usage: %s <image file name> <absolute path to file/link>\n", argv[0]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        exit(1);
-    }
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    // Initalize the global variables
-    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
-    block_bitmap = disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE;
-    inode_bitmap = disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE;
-    inode_table = (struct ext2_inode *)(disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    share_image();
+    open_image(argv[1]);
 
     char *path = argv[2];
     validate_path(path, ABS_PATH);
@@ -53,18 +40,10 @@ int main(int argc, char **argv) {
     /******************************************************************
 	 * Remove
 	 ******************************************************************/
+    stats_phase("remove");
     remove_dir_entry(inode, name,prev_inode);
 
-    if (close(fd) == -1) {
-        perror("close");
-        exit(1);
-    }
-
-    int ret = munmap(disk, 128 * 1024);
-    if (ret == -1) {
-        perror("munmap");
-        exit(1);
-    }
+    close_image();
     /******************************************************************
 	 * End
 	 ******************************************************************/
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+// Bytes read from a native file at a time
+#define SUM_READ_SIZE (64 * 1024)
+
+// What a compare found for a native file
+#define NATIVE_MATCH 0
+#define NATIVE_DIFFERS 1
+#define NATIVE_MISSING 2
+
+// One regular file to hash
+struct sum_job {
+    struct tree_entry *entry;
+    char *native;               // the native file to compare with, or NULL
+    unsigned int sum;           // crc32c of the contents in the image
+    int corrupt;                // its block map cannot be walked
+    int native_state;
+};
+
+// Workers hand out jobs in order through next
+struct sum_pool {
+    struct sum_job *jobs;
+    int count;
+    int next;
+};
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONAL -c native path to compare with] <image file name> "
+            "[OPTIONAL absolute path]\n", prog);
+    exit(1);
+}
+
+static int compare_path(const void *a, const void *b) {
+    return strcmp(((struct tree_entry *)a)->path, ((struct tree_entry *)b)->path);
+}
+
+// Hash the contents of inode straight from its blocks. The map is walked by
+// logical block up to i_size rather than by i_blocks, so holes (a zero
+// block number, or no indirect block at all) read as zeros.
+// It returns -1 if the block map is corrupt.
+static int sum_inode(int inode, unsigned int *sum) {
+    static const unsigned char zeros[EXT2_BLOCK_SIZE];
+    struct ext2_inode *node = &inode_table[inode - 1];
+    unsigned int size = node->i_size;
+    int logical = (size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    if (logical > INODE_LIST_MAX - 1 || node->i_block[13] != 0 || node->i_block[14] != 0) {
+        return -1;
+    }
+    // list[i] is the block holding logical block i, 0 for a hole
+    int list[INODE_LIST_MAX];
+    for (int i = 0; i < logical && i < 12; i++) {
+        list[i] = node->i_block[i];
+    }
+    if (logical > 12) {
+        unsigned int indirect = node->i_block[12];
+        if (indirect >= sb->s_blocks_count) {
+            return -1;
+        }
+        for (int i = 12; i < logical; i++) {
+            list[i] = 0;
+            if (indirect != 0) {
+                memcpy(&list[i], get_block(indirect) + 4 * (i - 12), sizeof(int));
+            }
+        }
+    }
+    for (int i = 0; i < logical; i++) {
+        if (list[i] < 0 || list[i] >= sb->s_blocks_count) {
+            return -1;
+        }
+    }
+    prefetch_blocks(list, logical);
+    unsigned int crc = ~0U;
+    unsigned int left = size;
+    for (int i = 0; i < logical; i++) {
+        unsigned int bytes = left < EXT2_BLOCK_SIZE ? left : EXT2_BLOCK_SIZE;
+        crc = crc32c(crc, list[i] == 0 ? zeros : get_block(list[i]), bytes);
+        left -= bytes;
+    }
+    *sum = ~crc;
+    return 0;
+}
+
+// Hash a native file the same way
+static int sum_native(char *path, unsigned int *sum) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    unsigned char *buf = malloc(SUM_READ_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned int crc = ~0U;
+    ssize_t n;
+    while ((n = read(fd, buf, SUM_READ_SIZE)) > 0) {
+        crc = crc32c(crc, buf, n);
+    }
+    free(buf);
+    close(fd);
+    if (n == -1) {
+        return -1;
+    }
+    *sum = ~crc;
+    return 0;
+}
+
+static void *sum_worker(void *arg) {
+    struct sum_pool *pool = arg;
+    int k;
+    while ((k = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        struct sum_job *job = &pool->jobs[k];
+        job->corrupt = sum_inode(job->entry->inode, &job->sum) == -1;
+        if (job->native != NULL) {
+            unsigned int native_sum;
+            if (sum_native(job->native, &native_sum) == -1) {
+                job->native_state = NATIVE_MISSING;
+            } else {
+                job->native_state = native_sum == job->sum ? NATIVE_MATCH : NATIVE_DIFFERS;
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    char *native = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c':
+            native = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(argv[0]);
+    }
+    char path[PATH_MAX];
+    char *arg = optind == argc - 2 ? argv[optind + 1] : "/";
+    if (strlen(arg) >= sizeof(path)) {
+        fprintf(stderr, "ERROR: %s's length is too long\n", arg);
+        exit(ENOENT);
+    }
+    strcpy(path, arg);
+    validate_path(path, ABS_PATH);
+    // Trailing slashes name the same file
+    for (int len = strlen(path); len > 1 && path[len - 1] == '/'; len--) {
+        path[len - 1] = '\0';
+    }
+    // Only reads, so writers carry on and the image is hashed again if one
+    // changed it meanwhile.
+    open_image_readonly(argv[optind]);
+
+    /******************************************************************
+	 * Walk the tree and hash
+	 ******************************************************************/
+    struct tree_entry *entries = NULL;
+    struct sum_job *jobs = NULL;
+    int count = 0;
+    int files = 0;
+    unsigned int generation;
+    do {
+        generation = read_begin();
+        free_tree(entries, count);
+        for (int i = 0; i < files; i++) {
+            free(jobs[i].native);
+        }
+        free(jobs);
+
+        stats_phase("walk");
+        int prev;
+        int inode = inode_num(path, &prev);
+        if (inode == 0 || inode > sb->s_inodes_count) {
+            fprintf(stderr, "ERROR: file or directory %s does not exist.\n", path);
+            exit(ENOENT);
+        }
+        count = walk_tree(path, inode, &entries);
+        qsort(entries, count, sizeof(struct tree_entry), compare_path);
+        jobs = calloc(count, sizeof(struct sum_job));
+        if (jobs == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        files = 0;
+        for (int i = 0; i < count; i++) {
+            if (entries[i].type != EXT2_FT_REG_FILE) {
+                continue;
+            }
+            struct sum_job *job = &jobs[files++];
+            job->entry = &entries[i];
+            if (native != NULL) {
+                // The native path stands for the image path, so the rest of
+                // each entry's path is appended to it
+                char *rest = entries[i].path + strlen(path);
+                rest += rest[0] == '/';
+                job->native = malloc(strlen(native) + strlen(rest) + 2);
+                if (job->native == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+                sprintf(job->native, "%s%s%s", native, rest[0] ? "/" : "", rest);
+            }
+        }
+
+        stats_phase("hash");
+        struct sum_pool pool = { jobs, files, 0 };
+        int threads = worker_threads(files, SUM_PARALLEL_MIN);
+        if (threads > files) {
+            threads = files;
+        }
+        if (threads > 1) {
+            pthread_t tids[HELPER_MAX_THREADS];
+            for (int i = 0; i < threads; i++) {
+                if (pthread_create(&tids[i], NULL, sum_worker, &pool) != 0) {
+                    perror("pthread_create");
+                    exit(1);
+                }
+            }
+            for (int i = 0; i < threads; i++) {
+                pthread_join(tids[i], NULL);
+            }
+        } else {
+            sum_worker(&pool);
+        }
+    } while (read_retry(generation));
+
+    /******************************************************************
+	 * Report
+	 ******************************************************************/
+    stats_phase("report");
+    int failed = 0;
+    for (int i = 0; i < files; i++) {
+        struct sum_job *job = &jobs[i];
+        if (job->corrupt) {
+            fprintf(stderr, "ERROR: %s is corrupt\n", job->entry->path);
+            failed++;
+        } else if (native == NULL) {
+            printf("%08x  %s\n", job->sum, job->entry->path);
+        } else if (job->native_state == NATIVE_MATCH) {
+            printf("%s: OK\n", job->entry->path);
+        } else {
+            printf("%s: %s\n", job->entry->path,
+                   job->native_state == NATIVE_MISSING ? "MISSING" : "DIFFERS");
+            failed++;
+        }
+    }
+    if (native != NULL) {
+        printf("%d of %d files match\n", files - failed, files);
+    }
+    for (int i = 0; i < files; i++) {
+        free(jobs[i].native);
+    }
+    free(jobs);
+    free_tree(entries, count);
+
+    close_image();
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return failed > 0;
+}
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONAL -n] [OPTIONAL -t max age in seconds] <image file name>\n", prog);
+    exit(1);
+}
+
+// Most recently deleted first
+int compare_dtime(const void *a, const void *b) {
+    unsigned int x = inode_table[*(int *)a - 1].i_dtime;
+    unsigned int y = inode_table[*(int *)b - 1].i_dtime;
+    return (x < y) - (x > y);
+}
+
+// scan_deleted finds the deleted inodes to relink, most recently deleted
+// first, and returns how many it kept in found; *total is how many it
+// found before dropping the ones that claim a block a kept one claims.
+// claimed is scratch space of BLOCK_BITMAP_SIZE bytes.
+int scan_deleted(int *found, int *total, long max_age, unsigned char *claimed) {
+    int n = find_deleted_inodes(found);
+    if (max_age > 0) {
+        long now = time(NULL);
+        int recent = 0;
+        for (int i = 0; i < n; i++) {
+            if (now - inode_table[found[i] - 1].i_dtime <= max_age) {
+                found[recent++] = found[i];
+            }
+        }
+        n = recent;
+    }
+    qsort(found, n, sizeof(int), compare_dtime);
+    *total = n;
+
+    // Deleted inodes may share blocks that were freed twice. The block then
+    // holds what the most recent owner wrote, so earlier claims win.
+    memset(claimed, 0, BLOCK_BITMAP_SIZE);
+    int list[INODE_LIST_MAX];
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        // Checked by find_deleted_inodes, but a writer may have changed it
+        // since under a read-only scan
+        int blocks = inode_block_list(found[i], list);
+        int conflict = blocks < 0;
+        for (int j = 0; j < blocks && !conflict; j++) {
+            conflict = list[j] <= 0 || list[j] >= sb->s_blocks_count || is_set(claimed, list[j]);
+        }
+        if (conflict) {
+            continue;
+        }
+        for (int j = 0; j < blocks; j++) {
+            claimed[(list[j] - 1) / 8] |= 1 << ((list[j] - 1) % 8);
+        }
+        found[kept++] = found[i];
+    }
+    return kept;
+}
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    int dry_run = 0;
+    long max_age = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "nt:")) != -1) {
+        switch (opt) {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 't':
+            max_age = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    if (max_age < 0) {
+        fprintf(stderr, "ERROR: max age must not be negative\n");
+        exit(EINVAL);
+    }
+    // A dry run only reads, so it maps the image read-only and lets
+    // writers carry on, scanning again if one changed the image meanwhile.
+    if (dry_run) {
+        open_image_readonly(argv[optind]);
+    } else {
+        open_image(argv[optind]);
+    }
+
+    /******************************************************************
+	 * Scan the inode table
+	 ******************************************************************/
+    stats_phase("scan");
+    int written = written_inodes();
+    if (written == 0) {
+        fprintf(stderr, "Skipped: the inode table is lazily initialized, so no free inode can be trusted\n");
+    } else if (written < sb->s_inodes_count) {
+        fprintf(stderr, "Skipped: inodes past [%d]: the lazily initialized inode table was never written there\n",
+                written);
+    }
+    int *found = malloc(sb->s_inodes_count * sizeof(int));
+    unsigned int *dtimes = malloc(sb->s_inodes_count * sizeof(unsigned int));
+    unsigned int *sizes = malloc(sb->s_inodes_count * sizeof(unsigned int));
+    unsigned char *claimed = malloc(BLOCK_BITMAP_SIZE);
+    if (found == NULL || dtimes == NULL || sizes == NULL || claimed == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned int generation = 0;
+    int lost_found, n, kept;
+    do {
+        if (dry_run) {
+            generation = read_begin();
+        }
+        lost_found = check_exist("lost+found", EXT2_ROOT_INO);
+        kept = scan_deleted(found, &n, max_age, claimed);
+        for (int i = 0; i < kept; i++) {
+            dtimes[i] = inode_table[found[i] - 1].i_dtime;
+            sizes[i] = inode_table[found[i] - 1].i_size;
+        }
+    } while (dry_run && read_retry(generation));
+    free(claimed);
+    if (lost_found == 0 || lost_found > sb->s_inodes_count || !IS_S_DIR(lost_found)) {
+        fprintf(stderr, "ERROR: /lost+found does not exist\n");
+        exit(ENOENT);
+    }
+
+    /******************************************************************
+	 * Relink under lost+found
+	 ******************************************************************/
+    stats_phase("relink");
+    if (!dry_run && kept > gd->bg_free_inodes_count) {
+        fprintf(stderr, "ERROR: Not enough space in the file system\n");
+        exit(ENOSPC);
+    }
+    long now = time(NULL);
+    for (int i = 0; i < kept; i++) {
+        printf("inode [%d]: deleted %lds ago, %d bytes -> /lost+found/#%d\n", found[i],
+               now - dtimes[i], sizes[i], found[i]);
+    }
+    free(dtimes);
+    free(sizes);
+
+    int list[INODE_LIST_MAX];
+
+    // Take every block back before adding any entry, so a new
+    // lost+found block cannot land on a file still waiting to be relinked.
+    for (int i = 0; i < kept && !dry_run; i++) {
+        int inode = found[i];
+        set_block_list(list, inode_block_list(inode, list));
+        set_bit(inode_bitmap, inode, INODE_BITMAP_SIZE);
+        inode_table[inode - 1].i_links_count = 1;
+        inode_table[inode - 1].i_dtime = 0;
+        update_inode_csum(inode);
+    }
+    char name[EXT2_NAME_LEN];
+    for (int i = 0; i < kept && !dry_run; i++) {
+        int inode = found[i];
+        snprintf(name, sizeof(name), "#%d", inode);
+        int type = (inode_table[inode - 1].i_mode & 0xF000) == EXT2_S_IFLNK ? EXT2_FT_SYMLINK
+                                                                           : EXT2_FT_REG_FILE;
+        insert_dir_entry(inode, name, lost_found, type);
+    }
+    printf("%s %d of %d deleted inodes\n", dry_run ? "Would relink" : "Relinked", kept, n);
+    free(found);
+
+    close_image();
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return 0;
+}
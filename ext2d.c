@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "ext2_helper.h"
+#include "ext2_io.h"
+#include "ext2d.h"
+
+// The tools are compiled into the daemon with their main renamed, as in
+// ext2_replay, and run against the images it holds open.
+#define main ext2_mkdir_main
+#include "ext2_mkdir.c"
+#undef main
+#define main ext2_cp_main
+#include "ext2_cp.c"
+#undef main
+#define main ext2_ln_main
+#include "ext2_ln.c"
+#undef main
+#define main ext2_rm_main
+#include "ext2_rm.c"
+#undef main
+#define main ext2_restore_main
+#include "ext2_restore.c"
+#undef main
+
+// Paths looked up by the read ops, per image, in a direct-mapped table
+#define DENTRY_SLOTS 4096
+
+struct tool_op {
+    char *name;
+    int (*run)(int argc, char **argv);
+};
+
+static struct tool_op tool_ops[EXT2D_OP_COUNT] = {
+    [EXT2D_MKDIR] = { "ext2_mkdir", ext2_mkdir_main }, [EXT2D_CP] = { "ext2_cp", ext2_cp_main },
+    [EXT2D_LN] = { "ext2_ln", ext2_ln_main }, [EXT2D_RM] = { "ext2_rm", ext2_rm_main },
+    [EXT2D_RESTORE] = { "ext2_restore", ext2_restore_main },
+};
+
+struct dentry {
+    char *path;
+    int inode;
+    unsigned int generation;    // writer generation it was looked up in
+};
+
+static char **image_paths;
+static int image_count;
+static int selected = -1;       // image the globals point at
+static char *socket_path = EXT2D_SOCKET;
+static volatile sig_atomic_t stopping;
+
+// Tool ops change the globals and the images, so they run alone; read ops
+// share the lock and run side by side.
+static pthread_rwlock_t state_lock = PTHREAD_RWLOCK_INITIALIZER;
+// The dentry cache of image i is dentries[i * DENTRY_SLOTS...]. It is
+// emptied whenever a tool op runs on the image, and an entry from an older
+// writer generation is a miss, so changes by other processes are seen too.
+static struct dentry *dentries;
+static pthread_mutex_t dentry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The daemon is linked with -Wl,--wrap=exit: an error exit inside an op
+// lands here and unwinds back to the thread's op instead of ending ext2d.
+static __thread jmp_buf op_env;
+static __thread int op_running;
+
+void __real_exit(int status) __attribute__((noreturn));
+
+void __wrap_exit(int status) {
+    if (op_running) {
+        op_running = 0;
+        longjmp(op_env, status + 1);
+    }
+    __real_exit(status);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONAL -s socket path] <image file name>...\n", prog);
+    exit(1);
+}
+
+static void stop(int sig) {
+    stopping = 1;
+}
+
+static unsigned int hash_path(char *path) {
+    unsigned int h = 5381;
+    while (*path) {
+        h = h * 33 + (unsigned char)*path++;
+    }
+    return h;
+}
+
+static void forget_dentries(int image) {
+    pthread_mutex_lock(&dentry_mutex);
+    for (int i = image * DENTRY_SLOTS; i < (image + 1) * DENTRY_SLOTS; i++) {
+        free(dentries[i].path);
+        dentries[i].path = NULL;
+    }
+    pthread_mutex_unlock(&dentry_mutex);
+}
+
+// lookup returns the inode at path in the selected image, or 0. Every
+// directory on the way is looked up, and cached, the same way. generation
+// is the writer generation of the read op, from read_begin.
+static int lookup(int image, char *path, unsigned int generation) {
+    if (strcmp(path, "/") == 0) {
+        return EXT2_ROOT_INO;
+    }
+    struct dentry *slot = &dentries[image * DENTRY_SLOTS + hash_path(path) % DENTRY_SLOTS];
+    pthread_mutex_lock(&dentry_mutex);
+    if (slot->path != NULL && slot->generation == generation && strcmp(slot->path, path) == 0) {
+        int inode = slot->inode;
+        pthread_mutex_unlock(&dentry_mutex);
+        return inode;
+    }
+    pthread_mutex_unlock(&dentry_mutex);
+
+    char parent_path[PATH_MAX];
+    char *name = strrchr(path, '/');
+    if (name == NULL || name - path >= PATH_MAX) {
+        return 0;
+    }
+    if (name == path) {
+        strcpy(parent_path, "/");
+    } else {
+        memcpy(parent_path, path, name - path);
+        parent_path[name - path] = '\0';
+    }
+    int parent = lookup(image, parent_path, generation);
+    if (parent == 0 || !IS_S_DIR(parent)) {
+        return 0;
+    }
+    int inode = check_exist(name + 1, parent);
+    if (inode != 0) {
+        char *copy = strdup(path);
+        pthread_mutex_lock(&dentry_mutex);
+        free(slot->path);
+        slot->path = copy;
+        slot->inode = inode;
+        slot->generation = generation;
+        pthread_mutex_unlock(&dentry_mutex);
+    }
+    return inode;
+}
+
+// Append len bytes to a growing payload
+static void append(char **buf, uint32_t *len, uint32_t *capacity, const void *data, uint32_t n) {
+    if (*len + n > *capacity) {
+        while (*len + n > *capacity) {
+            *capacity = *capacity ? *capacity * 2 : EXT2_BLOCK_SIZE;
+        }
+        *buf = realloc(*buf, *capacity);
+        if (*buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+// Fail a read op with a message in the payload
+static int read_error(char **payload, uint32_t *len, int status, char *fmt, char *arg) {
+    char msg[PATH_MAX + 64];
+    int n = snprintf(msg, sizeof(msg), fmt, arg);
+    uint32_t capacity = 0;
+    append(payload, len, &capacity, msg, n < sizeof(msg) ? n : sizeof(msg) - 1);
+    return status;
+}
+
+// Answer a read op from the selected image, as of writer generation
+static int run_read(int op, int image, int argc, char **args, char **payload, uint32_t *len,
+                    unsigned int generation) {
+    if (argc != 1) {
+        return read_error(payload, len, EINVAL, "ERROR: %s takes one path\n", ext2d_op_name(op));
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", args[0]);
+    // Trailing slashes name the same file
+    for (int n = strlen(path); n > 1 && path[n - 1] == '/'; n--) {
+        path[n - 1] = '\0';
+    }
+    if (path[0] != '/') {
+        return read_error(payload, len, ENOENT, "ERROR: %s is not a valid path\n", path);
+    }
+    int inode = lookup(image, path, generation);
+    if (inode == 0) {
+        return read_error(payload, len, ENOENT, "ERROR: file or directory %s does not exist.\n", path);
+    }
+    struct ext2_inode *node = &inode_table[inode - 1];
+    uint32_t capacity = 0;
+
+    if (op == EXT2D_STAT) {
+        struct ext2d_stat st = { inode, node->i_mode, node->i_links_count, node->i_size, node->i_blocks };
+        append(payload, len, &capacity, &st, sizeof(st));
+        return 0;
+    }
+    if (op == EXT2D_READ && IS_S_DIR(inode)) {
+        return read_error(payload, len, EISDIR, "ERROR: %s is a directory\n", path);
+    }
+    if (op == EXT2D_LS && !IS_S_DIR(inode)) {
+        return read_error(payload, len, ENOTDIR, "ERROR: %s is not a directory\n", path);
+    }
+    int list[INODE_LIST_MAX];
+    if (IS_S_DIR(inode)) {
+        dir_read_lock(inode);
+    }
+    int n = inode_block_list(inode, list);
+    for (int i = 0; i < n; i++) {
+        if (list[i] <= 0 || list[i] >= sb->s_blocks_count) {
+            n = -1;
+        }
+    }
+    if (n < 0) {
+        if (IS_S_DIR(inode)) {
+            dir_unlock(inode);
+        }
+        return read_error(payload, len, EIO, "ERROR: %s is corrupt\n", path);
+    }
+    prefetch_blocks(list, n);
+    uint32_t left = node->i_size;
+    for (int i = 0; i < n; i++) {
+        // The indirect block holds no data
+        if (n > 12 && i == 12) {
+            continue;
+        }
+        unsigned char *block = get_block(list[i]);
+        if (op == EXT2D_READ) {
+            uint32_t bytes = left < EXT2_BLOCK_SIZE ? left : EXT2_BLOCK_SIZE;
+            append(payload, len, &capacity, block, bytes);
+            left -= bytes;
+            continue;
+        }
+        for (int off = 0; off < EXT2_BLOCK_SIZE; ) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + off);
+            // Only a writer in another process caught halfway leaves these;
+            // read_retry then has the op start over
+            if (entry->rec_len < 8 || off + entry->rec_len > EXT2_BLOCK_SIZE ||
+                entry->name_len > entry->rec_len - 8) {
+                break;
+            }
+            if (entry->inode != 0) {
+                append(payload, len, &capacity, entry->name, entry->name_len);
+                append(payload, len, &capacity, "", 1);
+            }
+            off += entry->rec_len;
+        }
+    }
+    if (IS_S_DIR(inode)) {
+        dir_unlock(inode);
+    }
+    return 0;
+}
+
+// Point the globals at image. Call with state_lock held for writing.
+static void select_image(int image) {
+    if (selected != image) {
+        open_image(image_paths[image]);
+        close_image();
+        selected = image;
+    }
+}
+
+// Run a read op with state_lock held for reading, switching images first
+// if needed.
+static int serve_read(int op, int image, int argc, char **args, char **payload, uint32_t *len) {
+    pthread_rwlock_rdlock(&state_lock);
+    while (selected != image) {
+        pthread_rwlock_unlock(&state_lock);
+        pthread_rwlock_wrlock(&state_lock);
+        select_image(image);
+        pthread_rwlock_unlock(&state_lock);
+        pthread_rwlock_rdlock(&state_lock);
+    }
+    // Other processes write the image meanwhile; what they were changing
+    // may have been read torn, so the op runs again until no writer began
+    volatile int status;
+    int jumped = setjmp(op_env);
+    if (jumped == 0) {
+        op_running = 1;
+        unsigned int generation;
+        do {
+            generation = read_begin();
+            *len = 0;
+            status = run_read(op, image, argc, args, payload, len, generation);
+        } while (read_retry(generation));
+        op_running = 0;
+    } else {
+        status = jumped - 1;
+    }
+    pthread_rwlock_unlock(&state_lock);
+    return status;
+}
+
+// Run a tool op alone, with its stdout and stderr collected as the payload
+static int serve_tool(int op, int image, int argc, char **args, char **payload, uint32_t *len) {
+    if (argc > EXT2D_MAX_ARGS) {
+        return read_error(payload, len, E2BIG, "ERROR: too many arguments for %s\n", ext2d_op_name(op));
+    }
+    // Restoring everything needs the image to itself
+    if (op == EXT2D_RESTORE && argc == 1 && strcmp(args[0], "--all") == 0) {
+        return read_error(payload, len, EINVAL, "ERROR: %s is not served by ext2d\n", "restore --all");
+    }
+    char *argv[EXT2D_MAX_ARGS + 3];
+    int n = 0;
+    argv[n++] = tool_ops[op].name;
+    argv[n++] = image_paths[image];
+    for (int i = 0; i < argc; i++) {
+        argv[n++] = args[i];
+    }
+    argv[n] = NULL;
+
+    pthread_rwlock_wrlock(&state_lock);
+    int out = memfd_create("ext2d", 0);
+    if (out == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = dup(STDERR_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(out, STDERR_FILENO);
+
+    volatile int status;
+    int jumped = setjmp(op_env);
+    if (jumped == 0) {
+        op_running = 1;
+        status = tool_ops[op].run(n, argv);
+        op_running = 0;
+    } else {
+        // The tool bailed out with the image still selected
+        status = jumped - 1;
+        release_image();
+    }
+    selected = image;
+    forget_dentries(image);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+    pthread_rwlock_unlock(&state_lock);
+
+    off_t size = lseek(out, 0, SEEK_END);
+    *payload = malloc(size > 0 ? size : 1);
+    if (*payload == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    *len = pread(out, *payload, size, 0) == size ? size : 0;
+    close(out);
+    return status;
+}
+
+// Serve the requests of one connection in order until it closes
+static void *serve(void *arg) {
+    int fd = (intptr_t)arg;
+    char buf[EXT2D_MAX_REQUEST + 1];
+    struct ext2d_request req;
+    while (ext2d_read_full(fd, &req, sizeof(req)) == 0) {
+        if (req.len > EXT2D_MAX_REQUEST || ext2d_read_full(fd, buf, req.len) == -1) {
+            break;
+        }
+        buf[req.len] = '\0';
+        char *args[EXT2D_MAX_ARGS + 1];
+        int argc = 0;
+        for (char *p = buf; p < buf + req.len && argc <= EXT2D_MAX_ARGS; p += strlen(p) + 1) {
+            args[argc++] = p;
+        }
+
+        char *payload = NULL;
+        uint32_t len = 0;
+        int status;
+        if (req.image >= image_count) {
+            status = read_error(&payload, &len, EINVAL, "ERROR: no image %s\n", "with that index");
+        } else if (req.op == EXT2D_STAT || req.op == EXT2D_READ || req.op == EXT2D_LS) {
+            status = serve_read(req.op, req.image, argc, args, &payload, &len);
+        } else if (req.op > 0 && req.op < EXT2D_OP_COUNT && tool_ops[req.op].run != NULL) {
+            status = serve_tool(req.op, req.image, argc, args, &payload, &len);
+        } else {
+            status = read_error(&payload, &len, EINVAL, "ERROR: unknown op %s\n", "in request");
+        }
+
+        struct ext2d_response resp = { len, status };
+        int failed = ext2d_write_full(fd, &resp, sizeof(resp)) == -1 || ext2d_write_full(fd, payload, len) == -1;
+        free(payload);
+        if (failed) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc || argc - optind > IO_MAX_HELD_IMAGES) {
+        usage(argv[0]);
+    }
+
+    /******************************************************************
+	 * Open the images and the socket
+	 ******************************************************************/
+    image_paths = argv + optind;
+    image_count = argc - optind;
+    for (int i = 0; i < image_count; i++) {
+        hold_image(image_paths[i]);
+        selected = i;
+    }
+    dentries = calloc(image_count * DENTRY_SLOTS, sizeof(struct dentry));
+    if (dentries == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: socket path %s is too long\n", socket_path);
+        exit(ENAMETOOLONG);
+    }
+    strcpy(addr.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || listen(listen_fd, SOMAXCONN) == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    // A signal ends the accept loop; without SA_RESTART accept returns
+    struct sigaction sa = { .sa_handler = stop };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /******************************************************************
+	 * Serve
+	 ******************************************************************/
+    while (!stopping) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, serve, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    // Let the ops in flight finish, then let go of the images
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_rwlock_wrlock(&state_lock);
+    release_held_images();
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef CSC369_EXT2D
+#define CSC369_EXT2D
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Where ext2d listens unless told otherwise
+#define EXT2D_SOCKET "/tmp/ext2d.sock"
+// Longest argument block of a request, in bytes
+#define EXT2D_MAX_REQUEST 8192
+// Most arguments an op takes after the image
+#define EXT2D_MAX_ARGS 8
+// Requests the CLI keeps in flight on one connection in batch mode
+#define EXT2D_PIPELINE_DEPTH 64
+
+// Ops served by ext2d. The tool ops run the tool of the same name with
+// the request's arguments; the read ops are answered by the daemon itself
+// and may run at the same time as each other.
+enum ext2d_op {
+    EXT2D_MKDIR = 1,
+    EXT2D_CP,
+    EXT2D_LN,
+    EXT2D_RM,
+    EXT2D_RESTORE,
+    EXT2D_STAT,         // path -> struct ext2d_stat
+    EXT2D_READ,         // path -> the file's contents
+    EXT2D_LS,           // path -> the names in the directory, each NUL terminated
+    EXT2D_OP_COUNT
+};
+
+// A request is this header followed by len bytes of NUL terminated
+// arguments. Requests on a connection are answered in order, so a client
+// may send several before reading any response.
+struct ext2d_request {
+    uint32_t len;
+    uint16_t op;
+    uint16_t image;     // index of the image in ext2d's command line
+};
+
+// A response is this header followed by len bytes of payload: the tool's
+// output for a tool op, the answer for a read op that succeeded, or an
+// error message.
+struct ext2d_response {
+    uint32_t len;
+    int32_t status;     // 0, or the exit status of the op
+};
+
+struct ext2d_stat {
+    uint32_t inode;
+    uint16_t mode;
+    uint16_t links;
+    uint32_t size;
+    uint32_t blocks;    // in 512-byte sectors, as i_blocks
+};
+
+// Client library. Every call returns -1 if the connection fails.
+int ext2d_connect(char *socket_path);
+int ext2d_send(int fd, int op, int image, int argc, char **argv);
+int ext2d_receive(int fd, int *status, char **payload, uint32_t *len);
+int ext2d_call(int fd, int op, int image, int argc, char **argv, int *status, char **payload, uint32_t *len);
+int ext2d_op(char *name);
+char *ext2d_op_name(int op);
+int ext2d_read_full(int fd, void *buf, size_t len);
+int ext2d_write_full(int fd, const void *buf, size_t len);
+
+#endif
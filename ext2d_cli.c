@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2d.h"
+
+// Longest line of a batch
+#define LINE_MAX_LEN 4096
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONAL -s socket path] [OPTIONAL -i image index] <op> <arg>...\n"
+            "       %s [OPTIONAL -s socket path] [OPTIONAL -i image index] -b\n"
+            "ops: mkdir cp ln rm restore stat read ls; -b reads one op per line from stdin\n", prog, prog);
+    exit(1);
+}
+
+// Print a response the way the tool would have: its output, or the answer
+// to a read op. It returns the op's status.
+int print_response(int op, int status, char *payload, uint32_t len) {
+    if (status != 0) {
+        fwrite(payload, 1, len, stderr);
+    } else if (op == EXT2D_STAT && len == sizeof(struct ext2d_stat)) {
+        struct ext2d_stat *st = (struct ext2d_stat *)payload;
+        printf("inode=%u mode=%o links=%u size=%u blocks=%u\n", st->inode, st->mode, st->links, st->size,
+               st->blocks);
+    } else if (op == EXT2D_LS) {
+        for (char *p = payload; p < payload + len; p += strlen(p) + 1) {
+            printf("%s\n", p);
+        }
+    } else {
+        fwrite(payload, 1, len, stdout);
+    }
+    return status;
+}
+
+int receive_one(int fd, int op) {
+    int status;
+    char *payload;
+    uint32_t len;
+    if (ext2d_receive(fd, &status, &payload, &len) == -1) {
+        fprintf(stderr, "ERROR: lost the connection to ext2d\n");
+        exit(1);
+    }
+    print_response(op, status, payload, len);
+    free(payload);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    char *socket_path = EXT2D_SOCKET;
+    int image = 0;
+    int batch = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "+s:i:b")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'i':
+            image = atoi(optarg);
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (batch ? optind != argc : optind == argc) {
+        usage(argv[0]);
+    }
+    int fd = ext2d_connect(socket_path);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: cannot connect to ext2d at %s: %s\n", socket_path, strerror(errno));
+        exit(1);
+    }
+
+    /******************************************************************
+	 * One op
+	 ******************************************************************/
+    if (!batch) {
+        int op = ext2d_op(argv[optind]);
+        if (op == 0) {
+            usage(argv[0]);
+        }
+        if (ext2d_send(fd, op, image, argc - optind - 1, argv + optind + 1) == -1) {
+            fprintf(stderr, "ERROR: cannot send to ext2d: %s\n", strerror(errno));
+            exit(1);
+        }
+        int status = receive_one(fd, op);
+        close(fd);
+        return status;
+    }
+
+    /******************************************************************
+	 * A batch, pipelined: up to EXT2D_PIPELINE_DEPTH ops in flight
+	 ******************************************************************/
+    int pending[EXT2D_PIPELINE_DEPTH];
+    int sent = 0;
+    int received = 0;
+    int failed = 0;
+    char line[LINE_MAX_LEN];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        char *args[EXT2D_MAX_ARGS + 2];
+        int n = 0;
+        for (char *tok = strtok(line, " \t\n"); tok != NULL && n < EXT2D_MAX_ARGS + 2; tok = strtok(NULL, " \t\n")) {
+            args[n++] = tok;
+        }
+        if (n == 0 || args[0][0] == '#') {
+            continue;
+        }
+        int op = ext2d_op(args[0]);
+        if (op == 0) {
+            fprintf(stderr, "ERROR: unknown op %s\n", args[0]);
+            failed++;
+            continue;
+        }
+        if (sent - received == EXT2D_PIPELINE_DEPTH) {
+            failed += receive_one(fd, pending[received++ % EXT2D_PIPELINE_DEPTH]) != 0;
+        }
+        if (ext2d_send(fd, op, image, n - 1, args + 1) == -1) {
+            fprintf(stderr, "ERROR: cannot send to ext2d: %s\n", strerror(errno));
+            exit(1);
+        }
+        pending[sent++ % EXT2D_PIPELINE_DEPTH] = op;
+    }
+    while (received < sent) {
+        failed += receive_one(fd, pending[received++ % EXT2D_PIPELINE_DEPTH]) != 0;
+    }
+    close(fd);
+    /******************************************************************
+	 * End
+	 ******************************************************************/
+
+    return failed > 0;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ext2d.h"
+
+static char *op_names[EXT2D_OP_COUNT] = {
+    [EXT2D_MKDIR] = "mkdir", [EXT2D_CP] = "cp", [EXT2D_LN] = "ln", [EXT2D_RM] = "rm",
+    [EXT2D_RESTORE] = "restore", [EXT2D_STAT] = "stat", [EXT2D_READ] = "read", [EXT2D_LS] = "ls",
+};
+
+// ext2d_op returns the op with the given name, or 0 if there is none
+int ext2d_op(char *name) {
+    for (int op = 1; op < EXT2D_OP_COUNT; op++) {
+        if (strcmp(name, op_names[op]) == 0) {
+            return op;
+        }
+    }
+    return 0;
+}
+
+char *ext2d_op_name(int op) {
+    return op > 0 && op < EXT2D_OP_COUNT ? op_names[op] : "unknown";
+}
+
+// Read/write exactly len bytes, retrying short transfers. Reading returns
+// -1 if the other end closes first.
+int ext2d_read_full(int fd, void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+int ext2d_write_full(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// ext2d_connect returns a connection to the daemon listening on
+// socket_path, or -1.
+int ext2d_connect(char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// ext2d_send queues one request without waiting for its response
+int ext2d_send(int fd, int op, int image, int argc, char **argv) {
+    char buf[sizeof(struct ext2d_request) + EXT2D_MAX_REQUEST];
+    struct ext2d_request req = { 0, op, image };
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        if (i >= EXT2D_MAX_ARGS || req.len + len > EXT2D_MAX_REQUEST) {
+            errno = E2BIG;
+            return -1;
+        }
+        memcpy(buf + sizeof(req) + req.len, argv[i], len);
+        req.len += len;
+    }
+    memcpy(buf, &req, sizeof(req));
+    return ext2d_write_full(fd, buf, sizeof(req) + req.len);
+}
+
+// ext2d_receive reads the response to the oldest request still unanswered.
+// The payload is NUL terminated for convenience; free it when done.
+int ext2d_receive(int fd, int *status, char **payload, uint32_t *len) {
+    struct ext2d_response resp;
+    if (ext2d_read_full(fd, &resp, sizeof(resp)) == -1) {
+        return -1;
+    }
+    *payload = malloc(resp.len + 1);
+    if (*payload == NULL) {
+        return -1;
+    }
+    if (ext2d_read_full(fd, *payload, resp.len) == -1) {
+        free(*payload);
+        return -1;
+    }
+    (*payload)[resp.len] = '\0';
+    *status = resp.status;
+    *len = resp.len;
+    return 0;
+}
+
+// ext2d_call sends one request and waits for its response
+int ext2d_call(int fd, int op, int image, int argc, char **argv, int *status, char **payload, uint32_t *len) {
+    if (ext2d_send(fd, op, image, argc, argv) == -1) {
+        return -1;
+    }
+    return ext2d_receive(fd, status, payload, len);
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../ext2.h"
+#include "../ext2_helper.h"
+#include "../ext2_io.h"
+
+// Fill an image from several threads at once, the way ext2_mkdir, ext2_cp
+// and ext2_ln change it: every thread makes a directory under / and under
+// /common, copies files into /common and links them into its directory,
+// and links /common/shared. Every op holds its parent with dir_write_lock
+// around check_exist and insert_dir_entry, as the tools do.
+
+#define FILE_BLOCKS 2
+
+static int threads;
+static int files;
+static int common;      // inode of /common
+static int shared;      // inode of /common/shared
+
+static void fail(char *what, char *name) {
+    fprintf(stderr, "ERROR: %s %s\n", what, name);
+    exit(1);
+}
+
+// Like ext2_mkdir
+static int make_dir(int parent, char *name) {
+    dir_write_lock(parent);
+    if (check_exist(name, parent)) {
+        fail("already exists:", name);
+    }
+    int inode = find_next_available(inode_bitmap, INODE_BITMAP_SIZE);
+    int block = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
+    if (inode <= 0 || block <= 0) {
+        fail("no space for", name);
+    }
+    links_lock(parent);
+    inode_table[parent - 1].i_links_count++;
+    update_inode_csum(parent);
+    links_unlock(parent);
+    memset(&inode_table[inode - 1], 0, sizeof(struct ext2_inode));
+    inode_table[inode - 1].i_mode = EXT2_S_IFDIR;
+    inode_table[inode - 1].i_size = EXT2_BLOCK_SIZE;
+    inode_table[inode - 1].i_links_count = 2;
+    inode_table[inode - 1].i_blocks = 2;
+    inode_table[inode - 1].i_block[0] = block;
+    update_inode_csum(inode);
+    insert_dir_entry(inode, name, parent, EXT2_FT_DIR);
+
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)get_new_block(block);
+    entry->inode = inode;
+    entry->rec_len = 12;
+    entry->name_len = 1;
+    entry->file_type = EXT2_FT_DIR;
+    memcpy(entry->name, ".", 1);
+    struct ext2_dir_entry *next = (struct ext2_dir_entry *)((char *)entry + entry->rec_len);
+    next->inode = parent;
+    next->rec_len = DIR_BLOCK_END - entry->rec_len;
+    next->name_len = 2;
+    next->file_type = EXT2_FT_DIR;
+    memcpy(next->name, "..", 2);
+    init_dir_tail((unsigned char *)entry);
+    update_dir_csum(inode, block);
+    add_used_dirs(1);
+    dir_unlock(parent);
+    return inode;
+}
+
+// Like ext2_cp of a FILE_BLOCKS block file
+static int make_file(int parent, char *name) {
+    int inode = find_next_available(inode_bitmap, INODE_BITMAP_SIZE);
+    if (inode <= 0) {
+        fail("no space for", name);
+    }
+    memset(&inode_table[inode - 1], 0, sizeof(struct ext2_inode));
+    inode_table[inode - 1].i_mode = EXT2_S_IFREG;
+    inode_table[inode - 1].i_size = FILE_BLOCKS * EXT2_BLOCK_SIZE;
+    inode_table[inode - 1].i_links_count = 1;
+    inode_table[inode - 1].i_blocks = FILE_BLOCKS * 2;
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        int block = find_next_available(block_bitmap, BLOCK_BITMAP_SIZE);
+        if (block <= 0) {
+            fail("no space for", name);
+        }
+        memset(get_new_block(block), inode & 0xff, EXT2_BLOCK_SIZE);
+        inode_table[inode - 1].i_block[i] = block;
+    }
+    update_inode_csum(inode);
+    dir_write_lock(parent);
+    if (check_exist(name, parent)) {
+        fail("already exists:", name);
+    }
+    insert_dir_entry(inode, name, parent, EXT2_FT_REG_FILE);
+    dir_unlock(parent);
+    return inode;
+}
+
+// Like ext2_ln without -s
+static void link_file(int inode, int parent, char *name) {
+    dir_write_lock(parent);
+    if (check_exist(name, parent)) {
+        fail("already exists:", name);
+    }
+    links_lock(inode);
+    inode_table[inode - 1].i_links_count++;
+    update_inode_csum(inode);
+    links_unlock(inode);
+    insert_dir_entry(inode, name, parent, EXT2_FT_REG_FILE);
+    dir_unlock(parent);
+}
+
+static void *fill(void *arg) {
+    int id = (int)(long)arg;
+    char name[64];
+    snprintf(name, sizeof(name), "t%d", id);
+    int own = make_dir(EXT2_ROOT_INO, name);
+    snprintf(name, sizeof(name), "s%d", id);
+    make_dir(common, name);
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "f%d_%d", id, i);
+        int inode = make_file(common, name);
+        snprintf(name, sizeof(name), "l%d", i);
+        link_file(inode, own, name);
+        snprintf(name, sizeof(name), "shared%d", i);
+        link_file(shared, own, name);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s <image file name> <threads> <files per thread>\n", argv[0]);
+        exit(1);
+    }
+    threads = atoi(argv[2]);
+    files = atoi(argv[3]);
+    if (threads < 1 || threads > HELPER_MAX_THREADS || files < 1) {
+        fprintf(stderr, "ERROR: threads must be 1 to %d and files at least 1\n", HELPER_MAX_THREADS);
+        exit(1);
+    }
+    share_image();
+    open_image(argv[1]);
+    if (!enable_concurrency()) {
+        fprintf(stderr, "ERROR: the I/O backend cannot be shared between threads\n");
+        exit(1);
+    }
+    common = make_dir(EXT2_ROOT_INO, "common");
+    shared = make_file(common, "shared");
+
+    pthread_t tids[HELPER_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, fill, (void *)(long)i) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    disable_concurrency();
+    close_image();
+    return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Threads making directories, files and links at once must leave a clean
+# image: every link and dir count right, every name in place.
+# Run from the top of the tree after make.
+
+img=${TMPDIR:-/tmp}/concurrent_fill.$$.img
+trap 'rm -f "$img" "$img.log"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# Directories only grow through their direct blocks, so /common keeps
+# below twelve blocks of entries
+threads=8
+files=40
+
+./ext2_mkfs "$img" 4096 > /dev/null || fail "mkfs"
+tests/concurrent_fill "$img" $threads $files || fail "concurrent_fill"
+
+if command -v e2fsck > /dev/null 2>&1; then
+    e2fsck -fn "$img" > "$img.log" 2>&1 || { cat "$img.log"; fail "e2fsck"; }
+fi
+# Regular file entries always show as a type mismatch to the checker
+./ext2_checker "$img" 2>&1 | grep "^Fixed" | grep -v "Entry type vs inode mismatch" > "$img.log"
+[ -s "$img.log" ] && { cat "$img.log"; fail "checker repaired the image"; }
+
+for i in $(seq 0 $((threads - 1))); do
+    ./ext2_sum "$img" /t$i > "$img.log" 2>&1 || fail "sum of /t$i"
+    [ $(grep -c "/l" "$img.log") -eq $files ] || fail "links missing in /t$i"
+done
+echo "PASS: concurrent_fill"
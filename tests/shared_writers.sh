@@ -0,0 +1,65 @@
+#!/bin/sh
+# Tools sharing one image must keep each other's changes: several workers
+# make directories, copy, link, remove and restore files at the same time,
+# and the image must come out clean with every name in place.
+# Run from the top of the tree after make.
+
+img=${TMPDIR:-/tmp}/shared_writers.$$.img
+data=${TMPDIR:-/tmp}/shared_writers.$$.data
+trap 'rm -f "$img" "$data" "$img.log"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+workers=4
+files=15
+
+./ext2_mkfs "$img" 4096 > /dev/null || fail "mkfs"
+head -c 3000 /dev/urandom > "$data"
+./ext2_mkdir "$img" /common || fail "mkdir /common"
+./ext2_cp "$img" "$data" /common/shared || fail "cp /common/shared"
+
+# Every worker adds to / and /common, links /common/shared, and takes a
+# file away and brings it back
+worker() {
+    ./ext2_mkdir "$img" /w$1 || exit 1
+    ./ext2_mkdir "$img" /common/s$1 || exit 1
+    i=0
+    while [ $i -lt $files ]; do
+        ./ext2_cp "$img" "$data" /common/f$1_$i || exit 1
+        ./ext2_ln "$img" /common/f$1_$i /w$1/l$i || exit 1
+        ./ext2_ln "$img" /common/shared /w$1/shared$i || exit 1
+        i=$((i + 1))
+    done
+    # Another worker may take the freed blocks before the restore, which
+    # then fails; the copy is made again instead
+    ./ext2_cp "$img" "$data" /w$1/gone || exit 1
+    ./ext2_rm "$img" /w$1/gone || exit 1
+    ./ext2_restore "$img" /w$1/gone 2> /dev/null || ./ext2_cp "$img" "$data" /w$1/gone || exit 1
+}
+
+pids=
+for w in $(seq 1 $workers); do
+    worker $w > /dev/null &
+    pids="$pids $!"
+done
+for pid in $pids; do
+    wait $pid || fail "a worker's tool failed"
+done
+
+if command -v e2fsck > /dev/null 2>&1; then
+    e2fsck -fn "$img" > "$img.log" 2>&1 || { cat "$img.log"; fail "e2fsck"; }
+fi
+# Regular file entries always show as a type mismatch to the checker
+./ext2_checker "$img" 2>&1 | grep "^Fixed" | grep -v "Entry type vs inode mismatch" > "$img.log"
+[ -s "$img.log" ] && { cat "$img.log"; fail "checker repaired the image"; }
+
+./ext2_sum "$img" /common > "$img.log" 2>&1 || fail "sum of /common"
+[ $(grep -c "/common/f" "$img.log") -eq $((workers * files)) ] || fail "files missing in /common"
+for w in $(seq 1 $workers); do
+    ./ext2_sum "$img" /w$w > "$img.log" 2>&1 || fail "sum of /w$w"
+    [ $(grep -c "/w$w/" "$img.log") -eq $((files * 2 + 1)) ] || fail "links missing in /w$w"
+done
+echo "PASS: shared_writers"